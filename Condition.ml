@@ -0,0 +1,29 @@
+(* Condition.ml - condition variables for threads
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Waiting threads block until signaled, see Thread_stubs.c
+ *)
+
+type t
+
+external create : unit -> t = "caml_condition_new"
+external wait : t -> Mutex.t -> unit = "caml_condition_wait"
+(* wait at most the given number of seconds, false if not signaled *)
+external timed_wait : t -> Mutex.t -> float -> bool = "caml_condition_timed_wait"
+external signal : t -> unit = "caml_condition_signal"
+external broadcast : t -> unit = "caml_condition_broadcast"
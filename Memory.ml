@@ -0,0 +1,54 @@
+(* Memory.ml - ocaml interface to the kernel allocator statistics
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Statistics of malloc/free in memory.c, the C side of Gc.stat
+ *)
+
+type stat = {
+  free : int;                  (* bytes in free chunks *)
+  used : int;                  (* bytes in allocated chunks *)
+  meta : int;                  (* bytes in chunk headers *)
+  largest_free : int;          (* largest free chunk *)
+  fragmentation : float;       (* 1 - largest_free / free *)
+  (* chunks per slot n, holding sizes [2^n, 2^(n+1)) *)
+  free_chunks : int array;
+  free_bytes : int array;
+  chunk_allocs : int array;
+  chunk_frees : int array;
+  (* small objects per slab size class *)
+  slab_size : int array;
+  slab_allocs : int array;
+  slab_frees : int array;
+}
+
+external stat : unit -> stat = "caml_memory_stat"
+
+let print stat =
+  Printf.printf "free = %d, used = %d, meta = %d, largest_free = %d, fragmentation = %.3f\n"
+    stat.free stat.used stat.meta stat.largest_free stat.fragmentation;
+  Array.iteri
+    (fun i count ->
+      if count > 0 || stat.chunk_allocs.(i) > 0 then
+        Printf.printf "  slot %2d: %d free (%d bytes), %d allocs, %d frees\n"
+          i count stat.free_bytes.(i) stat.chunk_allocs.(i) stat.chunk_frees.(i))
+    stat.free_chunks;
+  Array.iteri
+    (fun i size ->
+      Printf.printf "  slab %3d: %d allocs, %d frees\n"
+        size stat.slab_allocs.(i) stat.slab_frees.(i))
+    stat.slab_size
@@ -0,0 +1,72 @@
+/* Memory_stubs.c - stubs for the ocaml memory statistics interface
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Glue code to read the kernel allocator statistics from ocaml
+ */
+
+#include <stdint.h>
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include "memory.h"
+#include "stubs.h"
+
+value stubs_int_array(const size_t *data, int len) {
+    CAMLparam0();
+    CAMLlocal1(res);
+    res = caml_alloc(len, 0);
+    for(int i = 0; i < len; ++i) {
+	Store_field(res, i, Val_long(data[i]));
+    }
+    CAMLreturn(res);
+}
+
+// external stat : unit -> stat = "caml_memory_stat"
+CAMLprim value caml_memory_stat(value unit) {
+    CAMLparam1(unit);
+    CAMLlocal2(res, tmp);
+    // take a snapshot first, allocating below may grow the heap
+    MemoryStats stats = mem_stats;
+    size_t free_bytes = mem_free;
+    size_t used_bytes = mem_used;
+    size_t meta_bytes = mem_meta;
+    size_t largest = memory_largest_free();
+
+    res = caml_alloc_tuple(12);
+    Store_field(res, 0, Val_long(free_bytes));
+    Store_field(res, 1, Val_long(used_bytes));
+    Store_field(res, 2, Val_long(meta_bytes));
+    Store_field(res, 3, Val_long(largest));
+    tmp = caml_copy_double((free_bytes == 0) ? 0.0 : 1.0 - (double)largest / free_bytes);
+    Store_field(res, 4, tmp);
+    tmp = stubs_int_array(stats.free_chunks, MEMORY_NUM_SLOTS);
+    Store_field(res, 5, tmp);
+    tmp = stubs_int_array(stats.free_bytes, MEMORY_NUM_SLOTS);
+    Store_field(res, 6, tmp);
+    tmp = stubs_int_array(stats.chunk_allocs, MEMORY_NUM_SLOTS);
+    Store_field(res, 7, tmp);
+    tmp = stubs_int_array(stats.chunk_frees, MEMORY_NUM_SLOTS);
+    Store_field(res, 8, tmp);
+    tmp = stubs_int_array(slab_class_size, MEMORY_NUM_SLAB_CLASSES);
+    Store_field(res, 9, tmp);
+    tmp = stubs_int_array(stats.slab_allocs, MEMORY_NUM_SLAB_CLASSES);
+    Store_field(res, 10, tmp);
+    tmp = stubs_int_array(stats.slab_frees, MEMORY_NUM_SLAB_CLASSES);
+    Store_field(res, 11, tmp);
+    CAMLreturn(res);
+}
@@ -0,0 +1,28 @@
+(* Mutex.ml - locks for threads
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * A thread locking a held mutex blocks until the mutex is handed to it,
+ * see Thread_stubs.c
+ *)
+
+type t
+
+external create : unit -> t = "caml_mutex_new"
+external lock : t -> unit = "caml_mutex_lock"
+external try_lock : t -> bool = "caml_mutex_try_lock"
+external unlock : t -> unit = "caml_mutex_unlock"
@@ -4,6 +4,52 @@ external init : unit -> unit = "ocaml_thread_init"
 
 let () = init ()
 
-external create : (unit -> unit) -> t = "caml_thread_create"
+external create_with_stack : int -> (unit -> unit) -> t = "caml_thread_create"
+
+(* stack size of threads unless told otherwise, rounded up to 4k *)
+let default_stack_size = 1024 * 1024
+
+let create ?(stack_size = default_stack_size) fn = create_with_stack stack_size fn
+
 external yield : unit -> unit = "schedule"
+
+(* sleep for the given number of seconds, rounded up to the next tick of
+   the timer wheel (1.024ms); 0 or less just yields *)
+external delay : float -> unit = "caml_thread_delay"
+
+(* wait until the thread's function has returned, raising the exception
+   that ended it if it raised one *)
+external join : t -> unit = "caml_thread_join"
+
+external self : unit -> t = "caml_thread_self"
+external id : t -> int = "caml_thread_id"
+
+(* priorities go from 0 to 31, the highest ready one runs; threads start
+   with the priority of their creator, 16 for the first *)
+external set_priority : t -> int -> unit = "caml_thread_set_priority"
+external priority : t -> int = "caml_thread_priority"
+
+type stat = {
+  switches : int;              (* context switches *)
+  preemptions : int;           (* switches because a time slice ran out *)
+  reaped : int;                (* finished threads freed *)
+  stacks_pooled : int;         (* stacks kept for the next threads *)
+  (* wake-to-run latency in microseconds per priority *)
+  latency_count : int array;
+  latency_mean : int array;
+  latency_max : int array;
+}
+
+external stat : unit -> stat = "caml_thread_stat"
+
+(* the timer IRQ ends the time slice of the running thread by recording
+   signal 0, the next allocation then runs this handler *)
+external preempt : unit -> unit = "caml_thread_preempt"
+let preempt_signal = 0
+let () = Sys.set_signal preempt_signal (Sys.Signal_handle (fun _ -> preempt ()))
+
+(* length of a time slice in microseconds, 10ms unless told otherwise *)
+external set_quantum : int -> unit = "caml_thread_set_quantum"
+external quantum : unit -> int = "caml_thread_quantum"
+
 external signal : int -> unit = "caml_thread_signal"
@@ -1,14 +1,86 @@
 #include "printf.h"
+#include "trace.h"
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
 #include <caml/callback.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/custom.h>
+#include <caml/printexc.h>
+#include "memory.h"
+#include "irq.h"
+#include "list.h"
+#include "timer.h"
+#include "stubs.h"
 
-#define THREAD_STACK_SIZE 1024*1024
+#define THREAD_STACK_MIN 4096
 #define UNUSED(x) (void)(x)
 
+/* Pool of thread stacks
+ *
+ * Stacks are rounded up to a multiple of THREAD_STACK_MIN and kept in a
+ * free list when their thread is done, so the next thread asking for
+ * the same size gets one without touching the heap. A pooled stack
+ * stores its link at its base, the end a running thread reaches last.
+ */
+typedef struct FreeStack FreeStack;
+struct FreeStack {
+    FreeStack *next;
+    size_t size;
+};
+
+static FreeStack *free_stacks = NULL;
+size_t thread_stacks_pooled = 0;
+
+size_t thread_stack_round(size_t size) {
+    if (size < THREAD_STACK_MIN) size = THREAD_STACK_MIN;
+    return (size + THREAD_STACK_MIN - 1) & ~(size_t)(THREAD_STACK_MIN - 1);
+}
+
+// get a stack of size bytes (already rounded), NULL if out of memory
+void * thread_stack_alloc(size_t size) {
+    for(FreeStack **it = &free_stacks; *it != NULL; it = &(*it)->next) {
+	if ((*it)->size == size) {
+	    FreeStack *stack = *it;
+	    *it = stack->next;
+	    --thread_stacks_pooled;
+	    return stack;
+	}
+    }
+    return memalign(8, size);
+}
+
+// return the stack of a finished thread to the pool
+void thread_stack_free(void *base, size_t size) {
+    FreeStack *stack = (FreeStack *)base;
+    stack->next = free_stacks;
+    stack->size = size;
+    free_stacks = stack;
+    ++thread_stacks_pooled;
+}
+
 /* The infos on threads (allocated via malloc()) */
 
+enum ThreadState {
+    THREAD_READY,                 /* running or in ready_queue */
+    THREAD_BLOCKED,               /* in the wait queue of what it waits for */
+    THREAD_FINISHED,              /* its function returned */
+};
+
+struct channel;
+struct Mutex;
+
+/* Priorities: 0 is the lowest, THREAD_PRIORITIES - 1 the highest. The
+ * highest ready priority always runs, threads of equal priority take
+ * turns by time slice.
+ */
+enum {
+    THREAD_PRIORITIES = 32,
+    THREAD_PRIORITY_DEFAULT = 16,
+};
+
 struct caml_thread_struct {
+  value descr;                  /* The heap-allocated descriptor (root) */
   struct caml_thread_struct * next;  /* Double linking of running threads */
   struct caml_thread_struct * prev;
   char * top_of_stack;          /* Top of stack for this thread (approx.) */
@@ -22,13 +94,87 @@ struct caml_thread_struct {
   value backtrace_last_exn;     /* Saved backtrace_last_exn (root) */
 
     void *stack;
+    void *stack_base;             /* Lowest address of the stack */
+    size_t stack_size;            /* Size of the stack in bytes */
+    enum ThreadState state;
+    DList queue;                  /* Link in the ready or a wait queue */
+    struct caml_thread_struct *joiners; /* Threads waiting for the end */
+    struct channel *last_channel_locked; /* For caml_io_mutex_unlock_exn */
+    int base_priority;            /* Set by Thread.set_priority */
+    int priority;                 /* Raised by waiters on held mutexes */
+    struct Mutex *held;           /* Mutexes owned by the thread */
+    struct Mutex *blocked_on;     /* Mutex the thread waits for */
+    int woken;                    /* Made ready, not dispatched yet */
+    uint32_t woken_at;            /* Time of the wakeup for the latency */
+    struct caml_thread_struct **wait_queue; /* Queue to leave on a timeout */
+    Timer timeout;                /* Ends a timed wait */
+    int timed_out;                /* The last timed wait timed out */
 };
 
 typedef struct caml_thread_struct * caml_thread_t;
 
+/* Thread.t, the heap-allocated descriptor. It lives on as long as the
+ * OCaml side holds it, while the thread's own descriptor and stack are
+ * freed when the thread ends. Until then DESCR_THREAD holds the pointer
+ * to it with the low bit set, so the GC takes it for an int; afterwards
+ * Val_unit, which Thread_val() turns into NULL. DESCR_RESULT is 0 while
+ * the thread runs, 1 once it returned and Some exn if it raised exn.
+ */
+enum {
+    DESCR_IDENT,
+    DESCR_START,
+    DESCR_RESULT,
+    DESCR_THREAD,
+    DESCR_SIZE
+};
+
+#define Thread_val(v) ((caml_thread_t)(Field(v, DESCR_THREAD) & ~(value)1))
+#define Val_thread(th) ((value)(th) | 1)
+
 /* The descriptor for the currently executing thread */
 static caml_thread_t curr_thread = NULL;
 
+/* A finished thread still runs on its stack until it switched away, the
+ * next thread to run frees it.
+ */
+static caml_thread_t thread_dead = NULL;
+static intnat thread_next_ident = 0;
+uint32_t thread_reaped = 0;
+
+/* Threads that can run, one queue per priority in the order they will
+ * run, curr_thread is not in them. The IRQ handler makes threads ready
+ * too, so they are only touched with IRQs disabled.
+ */
+static caml_thread_t ready_queue[THREAD_PRIORITIES];
+static uint32_t ready_bitmap = 0; // bit n is set while ready_queue[n] has a thread
+
+static void ready_append(caml_thread_t th) {
+    DLIST_APPEND(&ready_queue[th->priority], th, queue);
+    ready_bitmap |= 1u << th->priority;
+}
+
+// highest priority with a ready thread, -1 if none
+static inline int ready_priority(void) {
+    if (ready_bitmap == 0) return -1;
+    return 31 - __builtin_clz(ready_bitmap);
+}
+
+static caml_thread_t ready_pop(void) {
+    int n = ready_priority();
+    caml_thread_t th = DLIST_POP(&ready_queue[n], queue);
+    if (ready_queue[n] == NULL) ready_bitmap &= ~(1u << n);
+    return th;
+}
+
+static void ready_remove(caml_thread_t th) {
+    int n = th->priority;
+    DLIST_REMOVE_FROM(&ready_queue[n], th, queue);
+    if (ready_queue[n] == NULL) ready_bitmap &= ~(1u << n);
+}
+
+// threads in thread_wait(), woken up by every IRQ
+static caml_thread_t irq_waiters = NULL;
+
 /* Hook for scanning the stacks of the other threads */
 
 typedef void (*scanning_action) (value, value *);
@@ -61,41 +207,288 @@ void switch_stack(void ** old_stack_p, void * new_stack) {
 }
 */
 extern void switch_thread(void ** old_stack_p, void * new_stack);
-extern void starter_stub(caml_thread_t thread, value fn);
+extern void starter_stub(caml_thread_t thread);
+
+/* Time slices
+ *
+ * Compare channel C1 of the system timer ends the time slice of the
+ * running thread after thread_quantum ticks (us). The timer IRQ can not
+ * switch threads itself, OCaml code may be anywhere in between two GC
+ * safe points. Instead thread_tick() records the preemption signal: the
+ * runtime makes the next allocation call into the signal handler set up
+ * in Thread.ml, which calls caml_thread_preempt(). Every switch starts a
+ * fresh slice for the next thread, whether it was preempted or gave up
+ * the CPU on its own, but only while another thread of its priority is
+ * ready: a thread running alone is not interrupted.
+ */
+enum {
+    THREAD_QUANTUM_DEFAULT = 10000,
+    THREAD_QUANTUM_MIN = 100,
+    THREAD_SIGNAL_PREEMPT = 0,
+};
+
+uint32_t thread_quantum = THREAD_QUANTUM_DEFAULT;
+uint32_t thread_preemptions = 0;
+uint32_t thread_switches = 0;
+// the running thread has used up its time slice
+static volatile int thread_slice_over = 0;
+
+// wake-to-run latency in ticks (us) per priority
+size_t thread_latency_count[THREAD_PRIORITIES];
+size_t thread_latency_max[THREAD_PRIORITIES];
+uint64_t thread_latency_total[THREAD_PRIORITIES];
+
+extern void time_slice_start(uint32_t ticks);
+extern void time_slice_stop(void);
+extern void time_slice_ensure(uint32_t ticks);
+extern uint32_t time_ticks(void);
+extern uint64_t time_now(void);
+extern void time_timer_add(Timer *timer, uint64_t time);
+extern void time_timer_cancel(Timer *timer);
+extern void caml_record_signal(int signal_number);
+
+// make the running thread call schedule() at its next safe point
+static void thread_request_preempt(void) {
+    thread_slice_over = 1;
+    caml_record_signal(THREAD_SIGNAL_PREEMPT);
+}
+
+// called from the timer IRQ when the time slice is used up
+void thread_tick(void) {
+    if (curr_thread != NULL && ready_priority() >= curr_thread->priority) {
+	thread_request_preempt();
+    }
+}
+
+// a ready thread has a higher priority than the running one
+static inline int thread_outranked(void) {
+    return ready_priority() > curr_thread->priority;
+}
+
+/* Save the stack-related global variables in the thread descriptor of
+   the current thread */
+static inline void thread_save_globals(caml_thread_t th) {
+    th->bottom_of_stack = caml_bottom_of_stack;
+    th->last_retaddr = caml_last_return_address;
+    th->gc_regs = caml_gc_regs;
+    th->exception_pointer = caml_exception_pointer;
+    th->local_roots = local_roots;
+    th->backtrace_pos = backtrace_pos;
+    th->backtrace_buffer = backtrace_buffer;
+    th->backtrace_last_exn = backtrace_last_exn;
+}
+
+/* Load the stack-related global variables from the thread descriptor of
+   the current thread */
+static inline void thread_load_globals(caml_thread_t th) {
+    caml_bottom_of_stack = th->bottom_of_stack;
+    caml_last_return_address = th->last_retaddr;
+    caml_gc_regs = th->gc_regs;
+    caml_exception_pointer = th->exception_pointer;
+    local_roots = th->local_roots;
+    backtrace_pos = th->backtrace_pos;
+    backtrace_buffer = th->backtrace_buffer;
+    backtrace_last_exn = th->backtrace_last_exn;
+}
 
+// free the stack and descriptor of the thread that finished last
+static void thread_reap(void) {
+    caml_thread_t th = thread_dead;
+    if (th == NULL) return;
+    TRACE_DEBUG("thread_reap(%p)", th);
+    thread_dead = NULL;
+    thread_stack_free(th->stack_base, th->stack_size);
+    free(th);
+    ++thread_reaped;
+}
+
+/* Switch to the highest priority ready thread. The current thread goes
+ * to the back of its ready queue unless it blocked or finished; if no
+ * thread can run wait for an IRQ to make one ready. Every thread keeps
+ * its own IRQ state across the switch.
+ */
 void schedule(void) {
-    printf("# schedule()\n");
-    if (curr_thread && (curr_thread != curr_thread->next)) {
-	/* Save the stack-related global variables in the thread descriptor
-	   of the current thread */
-	curr_thread->bottom_of_stack = caml_bottom_of_stack;
-	curr_thread->last_retaddr = caml_last_return_address;
-	curr_thread->gc_regs = caml_gc_regs;
-	curr_thread->exception_pointer = caml_exception_pointer;
-	curr_thread->local_roots = local_roots;
-	curr_thread->backtrace_pos = backtrace_pos;
-	curr_thread->backtrace_buffer = backtrace_buffer;
-	curr_thread->backtrace_last_exn = backtrace_last_exn;
+    TRACE_DEBUG("schedule()");
+    if (curr_thread == NULL) return;
+    uint32_t cpsr = irq_save();
+    if (curr_thread->state == THREAD_READY) {
+	if (ready_priority() < curr_thread->priority) {
+	    // nobody else may run
+	    irq_restore(cpsr);
+	    return;
+	}
+	ready_append(curr_thread);
+    }
+    while (ready_bitmap == 0) {
+	irq_wait();
+	// let the IRQ handler run
+	irq_unmask();
+	irq_save();
+    }
+    caml_thread_t next = ready_pop();
+    thread_slice_over = 0;
+    if (ready_priority() >= next->priority) {
+	time_slice_start(thread_quantum);
+    } else {
+	time_slice_stop();
+    }
+    if (next->woken) {
+	uint32_t latency = time_ticks() - next->woken_at;
+	next->woken = 0;
+	++thread_latency_count[next->priority];
+	thread_latency_total[next->priority] += latency;
+	if (latency > thread_latency_max[next->priority]) {
+	    thread_latency_max[next->priority] = latency;
+	}
+    }
+    if (next != curr_thread) {
+	thread_save_globals(curr_thread);
 
 	// switch threads
-	printf("# switching: old_stack = %p, new_stack = %p\n", curr_thread->stack, curr_thread->next->stack);
-	switch_thread(&curr_thread->stack, curr_thread->next->stack);
-	printf("# switched: old_stack = %p, new_stack = %p\n", curr_thread->stack, curr_thread->next->stack);
-	curr_thread = curr_thread->next;
-
-	/* Load the stack-related global variables in the thread descriptor
-	   of the current thread */
-	caml_bottom_of_stack = curr_thread->bottom_of_stack;
-	caml_last_return_address = curr_thread->last_retaddr;
-	caml_gc_regs = curr_thread->gc_regs;
-	caml_exception_pointer = curr_thread->exception_pointer;
-	local_roots = curr_thread->local_roots;
-	backtrace_pos = curr_thread->backtrace_pos;
-	backtrace_buffer = curr_thread->backtrace_buffer;
-	backtrace_last_exn = curr_thread->backtrace_last_exn;
+	++thread_switches;
+	TRACE_DEBUG("switching: old_stack = %p, new_stack = %p", curr_thread->stack, next->stack);
+	caml_thread_t prev = curr_thread;
+	curr_thread = next;
+	switch_thread(&prev->stack, next->stack);
+
+	thread_load_globals(curr_thread);
+	thread_reap();
+    }
+    irq_restore(cpsr);
+}
+
+// make a blocked thread ready to run, with IRQs disabled
+static void thread_ready(caml_thread_t th) {
+    time_timer_cancel(&th->timeout);
+    th->state = THREAD_READY;
+    th->woken = 1;
+    th->woken_at = time_ticks();
+    ready_append(th);
+    // it shares the CPU with the running thread
+    if (curr_thread != NULL && th->priority == curr_thread->priority) {
+	time_slice_ensure(thread_quantum);
+    }
+}
+
+static void thread_wakeup(caml_thread_t th) {
+    uint32_t cpsr = irq_save();
+    thread_ready(th);
+    irq_restore(cpsr);
+}
+
+/* Take the highest priority thread out of a wait queue, the one waiting
+ * longest among equals. Priorities of waiters change by inheritance, so
+ * the queue is kept in arrival order and searched.
+ */
+static caml_thread_t waiters_pop(caml_thread_t *waiters) {
+    // timeouts leave wait queues from the IRQ
+    uint32_t cpsr = irq_save();
+    caml_thread_t best = *waiters;
+    if (best != NULL) {
+	DLIST_ITERATOR_BEGIN(*waiters, queue, it) {
+	    if (it->priority > best->priority) best = it;
+	} DLIST_ITERATOR_END(it);
+	DLIST_REMOVE_FROM(waiters, best, queue);
+	best->wait_queue = NULL;
+    }
+    irq_restore(cpsr);
+    return best;
+}
+
+// wake up the first thread in a wait queue, NULL if there is none
+static caml_thread_t thread_wakeup_one(caml_thread_t *waiters) {
+    caml_thread_t th = waiters_pop(waiters);
+    if (th != NULL) thread_wakeup(th);
+    return th;
+}
+
+static void thread_wakeup_all(caml_thread_t *waiters) {
+    while (thread_wakeup_one(waiters) != NULL) { }
+}
+
+/* Block the current thread in a wait queue until it is woken up, without
+ * a queue only a timeout wakes it.
+ */
+static void thread_block(caml_thread_t *waiters) {
+    uint32_t cpsr = irq_save();
+    curr_thread->state = THREAD_BLOCKED;
+    curr_thread->wait_queue = waiters;
+    if (waiters != NULL) DLIST_APPEND(waiters, curr_thread, queue);
+    schedule();
+    irq_restore(cpsr);
+}
+
+// called from the timer IRQ when a timed wait is over
+static void thread_timeout(Timer *timer) {
+    caml_thread_t th = CONTAINER(struct caml_thread_struct, timeout, timer);
+    TRACE_DEBUG("thread_timeout(%p)", th);
+    if (th->wait_queue != NULL) {
+	DLIST_REMOVE_FROM(th->wait_queue, th, queue);
+	th->wait_queue = NULL;
+    }
+    th->timed_out = 1;
+    thread_ready(th);
+}
+
+// thread_block() until time (us) at the latest, 0 if it timed out
+static int thread_block_until(caml_thread_t *waiters, uint64_t time) {
+    uint32_t cpsr = irq_save();
+    curr_thread->timed_out = 0;
+    time_timer_add(&curr_thread->timeout, time);
+    thread_block(waiters);
+    irq_restore(cpsr);
+    return !curr_thread->timed_out;
+}
+
+// block the current thread for usec us, spin before threads are set up
+void thread_sleep(uint64_t usec) {
+    uint64_t time = time_now() + usec;
+    if (curr_thread == NULL) {
+	while (time_now() < time) { }
+    } else {
+	thread_block_until(NULL, time);
     }
 }
 
+// called from the IRQ handler after the drivers
+void thread_irq(void) {
+    while (irq_waiters != NULL) {
+	caml_thread_t th = DLIST_POP(&irq_waiters, queue);
+	th->wait_queue = NULL;
+	thread_ready(th);
+    }
+    if (curr_thread != NULL && thread_outranked()) thread_request_preempt();
+}
+
+/* external preempt : unit -> unit = "caml_thread_preempt"
+ * The handler of the preemption signal. A thread that yielded on its own
+ * since the signal was recorded keeps its new time slice.
+ */
+CAMLprim value caml_thread_preempt(value unit) {
+    UNUSED(unit);
+    if (thread_slice_over) {
+	++thread_preemptions;
+	schedule();
+    }
+    return Val_unit;
+}
+
+/* Block the current thread until ready() may have become true, i.e.
+ * until the next interrupt. ready() is checked with IRQs disabled so an
+ * interrupt arriving after the caller's own check still wakes us up.
+ */
+void thread_wait(int (*ready)(void)) {
+    uint32_t cpsr = irq_save();
+    if (!ready()) {
+	if (curr_thread != NULL) {
+	    thread_block(&irq_waiters);
+	} else {
+	    irq_wait();
+	}
+    }
+    irq_restore(cpsr);
+}
+
 CAMLextern void caml_do_local_roots(scanning_action f, char * bottom_of_stack,
                                     uintnat last_retaddr, value * gc_regs,
                                     struct caml__roots_block * local_roots);
@@ -108,7 +501,7 @@ static void caml_thread_scan_roots(scanning_action action)
     th = curr_thread;
     do {
 //	printf("#   thread @ %p\n", th);
-//	(*action)(th->descr, &th->descr);
+	(*action)(th->descr, &th->descr);
 	(*action)(th->backtrace_last_exn, &th->backtrace_last_exn);
 	/* Don't rescan the stack of the current thread, it was done already */
 	if (th != curr_thread) {
@@ -131,12 +524,12 @@ static void caml_thread_scan_roots(scanning_action action)
 
 static void caml_thread_enter_blocking_section(void)
 {
-    printf("# caml_thread_enter_blocking_section()\n");
+    TRACE_DEBUG("caml_thread_enter_blocking_section()");
 }
 
 static void caml_thread_leave_blocking_section(void)
 {
-    printf("# caml_thread_leave_blocking_section()\n");
+    TRACE_DEBUG("caml_thread_leave_blocking_section()");
 //    schedule();
 }
 
@@ -164,149 +557,343 @@ extern void (*caml_channel_mutex_free)(struct channel *);
 extern void (*caml_channel_mutex_lock)(struct channel *);
 extern void (*caml_channel_mutex_unlock)(struct channel *);
 extern void (*caml_channel_mutex_unlock_exn)(void);
-struct channel * last_channel_locked = NULL;
 
-#define DEBUG_IO_MUTEX 0
+/* Mutexes and condition variables
+ *
+ * Waiting threads are blocked in the wait queue of the mutex or
+ * condition and never run until they are woken up. Unlocking hands the
+ * mutex straight to the highest priority waiter, so it does not have to
+ * retry. Threads only switch in schedule(), never in between, so no
+ * further locking is needed.
+ *
+ * The owner of a mutex runs with the priority of its highest waiter if
+ * that is above its own, and passes it on to the owner of the mutex it
+ * waits for in turn. Otherwise a thread in the middle could keep the
+ * owner, and with it the waiter, off the CPU.
+ */
+typedef struct Mutex {
+    caml_thread_t owner;
+    caml_thread_t waiters;
+    DList held;                   /* Link in the owner's held mutexes */
+} Mutex;
+
+typedef struct Condition {
+    caml_thread_t waiters;
+} Condition;
+
+// change the priority a thread runs with, moving it between ready queues
+static void thread_set_priority(caml_thread_t th, int priority) {
+    uint32_t cpsr = irq_save();
+    if (th->state == THREAD_READY && th != curr_thread) {
+	ready_remove(th);
+	th->priority = priority;
+	ready_append(th);
+    } else {
+	th->priority = priority;
+    }
+    if (ready_priority() >= curr_thread->priority) time_slice_ensure(thread_quantum);
+    irq_restore(cpsr);
+}
+
+// highest priority in a wait queue, -1 if it is empty
+static int waiters_priority(caml_thread_t waiters) {
+    int priority = -1;
+    if (waiters != NULL) {
+	DLIST_ITERATOR_BEGIN(waiters, queue, it) {
+	    if (it->priority > priority) priority = it->priority;
+	} DLIST_ITERATOR_END(it);
+    }
+    return priority;
+}
+
+/* Recompute the priority of a thread from its own and the waiters on
+ * the mutexes it holds, and pass a change on along the chain.
+ */
+static void thread_update_priority(caml_thread_t th) {
+    int priority = th->base_priority;
+    if (th->held != NULL) {
+	DLIST_ITERATOR_BEGIN(th->held, held, mutex) {
+	    int waiting = waiters_priority(mutex->waiters);
+	    if (waiting > priority) priority = waiting;
+	} DLIST_ITERATOR_END(mutex);
+    }
+    if (priority == th->priority) return;
+    thread_set_priority(th, priority);
+    if (th->blocked_on != NULL) thread_update_priority(th->blocked_on->owner);
+}
+
+static void mutex_take(Mutex *mutex, caml_thread_t th) {
+    mutex->owner = th;
+    DLIST_INIT(mutex, held);
+    DLIST_PUSH(&th->held, mutex, held);
+}
+
+static void mutex_lock(Mutex *mutex) {
+    if (mutex->owner == NULL) {
+	mutex_take(mutex, curr_thread);
+    } else {
+	curr_thread->blocked_on = mutex;
+	DLIST_APPEND(&mutex->waiters, curr_thread, queue);
+	thread_update_priority(mutex->owner);
+	curr_thread->state = THREAD_BLOCKED;
+	// mutex_unlock() made us the owner
+	schedule();
+    }
+}
+
+static int mutex_trylock(Mutex *mutex) {
+    if (mutex->owner != NULL) return 0;
+    mutex_take(mutex, curr_thread);
+    return 1;
+}
+
+/* Hand the mutex to the highest priority waiter. The caller should check
+ * thread_outranked() afterwards, it may have lost inherited priority.
+ */
+static void mutex_unlock(Mutex *mutex) {
+    caml_thread_t th = mutex->owner;
+    DLIST_REMOVE_FROM(&th->held, mutex, held);
+    caml_thread_t next = waiters_pop(&mutex->waiters);
+    if (next != NULL) {
+	next->blocked_on = NULL;
+	mutex_take(mutex, next);
+	thread_update_priority(next);
+	thread_wakeup(next);
+    } else {
+	mutex->owner = NULL;
+    }
+    thread_update_priority(th);
+}
+
+static void condition_wait(Condition *cond, Mutex *mutex) {
+    mutex_unlock(mutex);
+    thread_block(&cond->waiters);
+    mutex_lock(mutex);
+}
+
+// condition_wait() until time (us) at the latest, 0 if it timed out
+static int condition_wait_until(Condition *cond, Mutex *mutex, uint64_t time) {
+    mutex_unlock(mutex);
+    int signaled = thread_block_until(&cond->waiters, time);
+    mutex_lock(mutex);
+    return signaled;
+}
+
+/* Hooks for I/O locking */
 
 static void caml_io_mutex_free(struct channel *chan) {
-    if (DEBUG_IO_MUTEX) printf("# caml_io_mutex_free(%p)\n", chan);
-    // Nothing to do
-    UNUSED(chan);
+    TRACE_DEBUG("caml_io_mutex_free(%p)", chan);
+    free(chan->mutex);
+    chan->mutex = NULL;
 }
 
-static int MUTEX_LOCKED = 0;
 static void caml_io_mutex_lock(struct channel *chan) {
-    if (DEBUG_IO_MUTEX) printf("# caml_io_mutex_lock(%p)\n", chan);
-    while(1) {
-	if (chan->mutex == NULL) {
-	    chan->mutex = &MUTEX_LOCKED;
-	    last_channel_locked = chan;
-	    if (DEBUG_IO_MUTEX) printf("# caml_io_mutex_lock(%p): locked\n", chan);
-	    return;
-	}
-	schedule();
+    TRACE_DEBUG("caml_io_mutex_lock(%p)", chan);
+    Mutex *mutex = chan->mutex;
+    if (mutex == NULL) {
+	mutex = calloc(1, sizeof(Mutex));
+	if (mutex == NULL) caml_raise_out_of_memory();
+	chan->mutex = mutex;
     }
+    mutex_lock(mutex);
+    curr_thread->last_channel_locked = chan;
+    TRACE_DEBUG("caml_io_mutex_lock(%p): locked", chan);
 }
 
 static void caml_io_mutex_unlock(struct channel *chan) {
-    if (DEBUG_IO_MUTEX) printf("# caml_io_mutex_unlock(%p) [%p]\n", chan, chan->mutex);
-    chan->mutex = NULL;
-    last_channel_locked = NULL;
+    TRACE_DEBUG("caml_io_mutex_unlock(%p) [%p]", chan, chan->mutex);
+    mutex_unlock(chan->mutex);
+    curr_thread->last_channel_locked = NULL;
+    // the runtime is in the middle of something, switch at the next safe point
+    if (thread_outranked()) thread_request_preempt();
 }
 
 static void caml_io_mutex_unlock_exn(void) {
-    if (DEBUG_IO_MUTEX) printf("# caml_io_mutex_unlock_exn(): last = %p\n", last_channel_locked);
-    if (last_channel_locked != NULL) caml_io_mutex_unlock(last_channel_locked);
+    struct channel *chan = curr_thread->last_channel_locked;
+    TRACE_DEBUG("caml_io_mutex_unlock_exn(): last = %p", chan);
+    if (chan != NULL) caml_io_mutex_unlock(chan);
 }
 
+/* The current thread is done: record how it ended for Thread.join, hand
+ * on the mutexes it still holds, wake up the joiners and switch away for
+ * good. The GC must not run once the thread left the ring, curr_thread
+ * is not in it any more.
+ */
+static void thread_exit(value result) {
+    CAMLparam0();
+    CAMLlocal2(exn, outcome);
+    caml_thread_t th = curr_thread;
+    TRACE_INFO("thread_exit(%p)", th);
+    if (Is_exception_result(result)) {
+	exn = Extract_exception(result);
+	char *msg = caml_format_exception(exn);
+	printf("Thread %ld killed on uncaught exception %s\n",
+	       (long)Long_val(Field(th->descr, DESCR_IDENT)), msg);
+	stat_free(msg);
+	outcome = caml_alloc_small(1, 0);
+	Field(outcome, 0) = exn;
+    } else {
+	outcome = Val_int(1);
+    }
+    Store_field(th->descr, DESCR_RESULT, outcome);
+    Store_field(th->descr, DESCR_START, Val_unit);
+    Store_field(th->descr, DESCR_THREAD, Val_unit);
 
-void starter(caml_thread_t th, value fn) {
-    printf("# starter()\n");
-    curr_thread = th;
+    // unlink from the ring of threads
+    th->prev->next = th->next;
+    th->next->prev = th->prev;
 
-    /* Load the stack-related global variables in the thread descriptor
-       of the current thread */
-    caml_bottom_of_stack = curr_thread->bottom_of_stack;
-    caml_last_return_address = curr_thread->last_retaddr;
-    caml_gc_regs = curr_thread->gc_regs;
-    caml_exception_pointer = curr_thread->exception_pointer;
-    local_roots = curr_thread->local_roots;
-    backtrace_pos = curr_thread->backtrace_pos;
-    backtrace_buffer = curr_thread->backtrace_buffer;
-    backtrace_last_exn = curr_thread->backtrace_last_exn;
+    // the mutexes must not keep pointing at the thread once it is reaped
+    while (th->held != NULL) mutex_unlock(th->held);
+    th->last_channel_locked = NULL;
 
-    // callback closure
-    callback_exn(fn, Val_unit);
+    th->state = THREAD_FINISHED;
+    thread_wakeup_all(&th->joiners);
+    thread_dead = th;
+    schedule();
     CRASH;
+    CAMLreturn0;
 }
 
-// FIXME: throw exception on failure
-CAMLprim value caml_thread_create(value fn)
-{
+void starter(caml_thread_t th) {
+    TRACE_INFO("starter()");
+    curr_thread = th;
+    thread_load_globals(curr_thread);
+    thread_reap();
+    // switched to with IRQs disabled by schedule()
+    irq_unmask();
+
+    // callback closure
+    thread_exit(callback_exn(Field(th->descr, DESCR_START), Val_unit));
+}
+
+// allocate the heap-allocated descriptor of a thread
+static value thread_new_descr(value fn) {
     CAMLparam1(fn);
+    CAMLlocal1(descr);
+    descr = caml_alloc_small(DESCR_SIZE, 0);
+    Field(descr, DESCR_IDENT) = Val_long(thread_next_ident++);
+    Field(descr, DESCR_START) = fn;
+    Field(descr, DESCR_RESULT) = Val_int(0);
+    Field(descr, DESCR_THREAD) = Val_unit;
+    CAMLreturn(descr);
+}
+
+// external create_with_stack : int -> (unit -> unit) -> t = "caml_thread_create"
+CAMLprim value caml_thread_create(value stack_size, value fn)
+{
+    CAMLparam2(stack_size, fn);
+    CAMLlocal1(descr);
     caml_thread_t th;
+    size_t size = thread_stack_round(Long_val(stack_size) > 0 ? Long_val(stack_size) : 0);
 
+    descr = thread_new_descr(fn);
     th = (caml_thread_t) malloc(sizeof(struct caml_thread_struct));
-    if (th != NULL) {
-	uint32_t *stack = stat_alloc(THREAD_STACK_SIZE);
-	if (stack == NULL) {
-	    free(th);
-	    th = NULL;
-	} else {
-	    uint32_t *top = stack + THREAD_STACK_SIZE / sizeof(uint32_t);
-	    th->bottom_of_stack = NULL;
-	    th->top_of_stack = (char *)top;
-	    th->last_retaddr = 1;
-	    th->gc_regs = NULL;
-	    th->exception_pointer = NULL;
-	    th->local_roots = NULL;
-	    th->backtrace_pos = 0;
-	    th->backtrace_buffer = NULL;
-	    th->backtrace_last_exn = Val_unit;
-	    
-	    // Build stack frame foro starter_stub
-	    *--top = (uint32_t)starter; // LR
-	    *--top = 3; // r3
-	    *--top = 2; // r2
-	    *--top = (uint32_t)fn; // r1
-	    *--top = (uint32_t)th; // r0
-	    // Build stack frame for schedule
-	    *--top = 0; // d15
-	    *--top = 0; // d15
-	    *--top = 0; // d14
-	    *--top = 0; // d14
-	    *--top = 0; // d13
-	    *--top = 0; // d13
-	    *--top = 0; // d12
-	    *--top = 0; // d12
-	    *--top = 0; // d11
-	    *--top = 0; // d11
-	    *--top = 0; // d10
-	    *--top = 0; // d10
-	    *--top = 0; // d9
-	    *--top = 0; // d9
-	    *--top = 0; // d8
-	    *--top = 0; // d8
-	    *--top = (uint32_t)starter_stub; // LR
-	    *--top = 12; // r12 scratch
-	    *--top = 11; // r11
-	    *--top = 10; // r10
-	    *--top = 9; // r9
-	    *--top = 8; // r8
-	    *--top = 7; // r7
-	    *--top = 6; // r6
-	    *--top = 5; // r5
-	    *--top = 4; // r4
-
-	    th->stack = top;
-	    
-	    /* Add thread info block to the list of threads */
-	    th->next = curr_thread->next;
-	    th->prev = curr_thread;
-	    curr_thread->next->prev = th;
-	    curr_thread->next = th;
-
-	    // start thread before the GC can clean up the closure
-	    schedule();
-	}
+    if (th == NULL) caml_raise_out_of_memory();
+    uint32_t *stack = thread_stack_alloc(size);
+    if (stack == NULL) {
+	free(th);
+	caml_raise_out_of_memory();
     }
+    uint32_t *top = stack + size / sizeof(uint32_t);
+    th->descr = descr;
+    Field(descr, DESCR_THREAD) = Val_thread(th);
+    th->stack_base = stack;
+    th->stack_size = size;
+    th->bottom_of_stack = NULL;
+    th->top_of_stack = (char *)top;
+    th->last_retaddr = 1;
+    th->gc_regs = NULL;
+    th->exception_pointer = NULL;
+    th->local_roots = NULL;
+    th->backtrace_pos = 0;
+    th->backtrace_buffer = NULL;
+    th->backtrace_last_exn = Val_unit;
+    th->state = THREAD_READY;
+    DLIST_INIT(th, queue);
+    th->joiners = NULL;
+    th->last_channel_locked = NULL;
+    // new threads inherit the priority, not what it was raised to
+    th->base_priority = curr_thread->base_priority;
+    th->priority = th->base_priority;
+    th->held = NULL;
+    th->blocked_on = NULL;
+    th->woken = 0;
+    th->wait_queue = NULL;
+    timer_setup(&th->timeout, thread_timeout);
     
-    CAMLreturn((value)th);
+    // Build stack frame foro starter_stub
+    *--top = (uint32_t)starter; // LR
+    *--top = 3; // r3
+    *--top = 2; // r2
+    *--top = 1; // r1
+    *--top = (uint32_t)th; // r0
+    // Build stack frame for schedule
+    *--top = 0; // d15
+    *--top = 0; // d15
+    *--top = 0; // d14
+    *--top = 0; // d14
+    *--top = 0; // d13
+    *--top = 0; // d13
+    *--top = 0; // d12
+    *--top = 0; // d12
+    *--top = 0; // d11
+    *--top = 0; // d11
+    *--top = 0; // d10
+    *--top = 0; // d10
+    *--top = 0; // d9
+    *--top = 0; // d9
+    *--top = 0; // d8
+    *--top = 0; // d8
+    *--top = (uint32_t)starter_stub; // LR
+    *--top = 12; // r12 scratch
+    *--top = 11; // r11
+    *--top = 10; // r10
+    *--top = 9; // r9
+    *--top = 8; // r8
+    *--top = 7; // r7
+    *--top = 6; // r6
+    *--top = 5; // r5
+    *--top = 4; // r4
+
+    th->stack = top;
+    
+    /* Add thread info block to the list of threads */
+    th->next = curr_thread->next;
+    th->prev = curr_thread;
+    curr_thread->next->prev = th;
+    curr_thread->next = th;
+
+    // start the thread right away unless it ranks below us
+    uint32_t cpsr = irq_save();
+    DLIST_PUSH(&ready_queue[th->priority], th, queue);
+    ready_bitmap |= 1u << th->priority;
+    irq_restore(cpsr);
+    schedule();
+
+    CAMLreturn(descr);
 }
 
 // external init : unit -> unit = "ocaml_thread_init"
 CAMLprim value ocaml_thread_init(value unit) {
     CAMLparam1(unit);
+    CAMLlocal1(descr);
     char c;
-    printf("# ocaml_thread_init()\n");
+    TRACE_INFO("ocaml_thread_init()");
     /* Protect against repeated initialization (PR#1325) */
     if (curr_thread != NULL) return Val_unit;
 
     /* Set up a thread info block for the current thread */
+    descr = thread_new_descr(Val_unit);
     curr_thread =
 	(caml_thread_t) stat_alloc(sizeof(struct caml_thread_struct));
+    curr_thread->descr = descr;
+    Field(descr, DESCR_THREAD) = Val_thread(curr_thread);
     curr_thread->bottom_of_stack = NULL;
     curr_thread->top_of_stack = &c;
+    // the boot stack is not ours to pool
+    curr_thread->stack_base = NULL;
+    curr_thread->stack_size = 0;
     curr_thread->last_retaddr = 1;
     curr_thread->gc_regs = NULL;
     curr_thread->exception_pointer = NULL;
@@ -314,6 +901,17 @@ CAMLprim value ocaml_thread_init(value unit) {
     curr_thread->backtrace_pos = 0;
     curr_thread->backtrace_buffer = NULL;
     curr_thread->backtrace_last_exn = Val_unit;
+    curr_thread->state = THREAD_READY;
+    DLIST_INIT(curr_thread, queue);
+    curr_thread->joiners = NULL;
+    curr_thread->last_channel_locked = NULL;
+    curr_thread->base_priority = THREAD_PRIORITY_DEFAULT;
+    curr_thread->priority = THREAD_PRIORITY_DEFAULT;
+    curr_thread->held = NULL;
+    curr_thread->blocked_on = NULL;
+    curr_thread->woken = 0;
+    curr_thread->wait_queue = NULL;
+    timer_setup(&curr_thread->timeout, thread_timeout);
 
     curr_thread->next = curr_thread;
     curr_thread->prev = curr_thread;
@@ -337,11 +935,241 @@ CAMLprim value ocaml_thread_init(value unit) {
 }
 
 // external signal : int -> unit = "ocaml_thread_signal"
-extern void caml_record_signal(int signal_number);
 CAMLprim value caml_thread_signal(value signal_number) {
     CAMLparam1(signal_number);
-    printf("# ocaml_thread_signal(%d)\n", Int_val(signal_number));
+    TRACE_DEBUG("ocaml_thread_signal(%d)", Int_val(signal_number));
     caml_record_signal(Int_val(signal_number));
     CAMLreturn(Val_unit);
 }
 
+
+// external set_quantum : int -> unit = "caml_thread_set_quantum"
+CAMLprim value caml_thread_set_quantum(value usec) {
+    CAMLparam1(usec);
+    long quantum = Long_val(usec);
+    if (quantum < THREAD_QUANTUM_MIN) caml_invalid_argument("Thread.set_quantum");
+    thread_quantum = quantum;
+    CAMLreturn(Val_unit);
+}
+
+// external quantum : unit -> int = "caml_thread_quantum"
+CAMLprim value caml_thread_quantum(value unit) {
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(thread_quantum));
+}
+
+// external join : t -> unit = "caml_thread_join"
+CAMLprim value caml_thread_join(value descr) {
+    CAMLparam1(descr);
+    CAMLlocal1(result);
+    caml_thread_t th = Thread_val(descr);
+    if (th == curr_thread) caml_failwith("Thread.join: deadlock");
+    // the descriptor is gone once the thread finished
+    while ((th = Thread_val(descr)) != NULL) thread_block(&th->joiners);
+    result = Field(descr, DESCR_RESULT);
+    if (Is_block(result)) caml_raise(Field(result, 0));
+    CAMLreturn(Val_unit);
+}
+
+// longer delays, infinity included, wait this long: 146000 years
+#define DELAY_MAX_US (1ull << 62)
+
+// seconds from OCaml in us, 0 for NaN and anything not positive
+static uint64_t delay_us(double d) {
+    if (!(d > 0)) return 0;
+    if (d >= DELAY_MAX_US / 1e6) return DELAY_MAX_US;
+    return (uint64_t)(d * 1e6);
+}
+
+/* external delay : float -> unit = "caml_thread_delay"
+ * Sleep for the given number of seconds, a delay of 0 or less yields.
+ */
+CAMLprim value caml_thread_delay(value sec) {
+    CAMLparam1(sec);
+    double d = Double_val(sec);
+    if (d > 0) {
+	thread_sleep(delay_us(d));
+    } else {
+	schedule();
+    }
+    CAMLreturn(Val_unit);
+}
+
+// external self : unit -> t = "caml_thread_self"
+CAMLprim value caml_thread_self(value unit) {
+    UNUSED(unit);
+    return curr_thread->descr;
+}
+
+// external id : t -> int = "caml_thread_id"
+CAMLprim value caml_thread_id(value descr) {
+    return Field(descr, DESCR_IDENT);
+}
+
+// external stat : unit -> stat = "caml_thread_stat"
+CAMLprim value caml_thread_stat(value unit) {
+    CAMLparam1(unit);
+    CAMLlocal1(res);
+    CAMLlocal1(tmp);
+    size_t mean[THREAD_PRIORITIES];
+    for (int i = 0; i < THREAD_PRIORITIES; ++i) {
+	mean[i] = thread_latency_count[i] ? thread_latency_total[i] / thread_latency_count[i] : 0;
+    }
+    res = caml_alloc_tuple(7);
+    Store_field(res, 0, Val_long(thread_switches));
+    Store_field(res, 1, Val_long(thread_preemptions));
+    Store_field(res, 2, Val_long(thread_reaped));
+    Store_field(res, 3, Val_long(thread_stacks_pooled));
+    tmp = stubs_int_array(thread_latency_count, THREAD_PRIORITIES);
+    Store_field(res, 4, tmp);
+    tmp = stubs_int_array(mean, THREAD_PRIORITIES);
+    Store_field(res, 5, tmp);
+    tmp = stubs_int_array(thread_latency_max, THREAD_PRIORITIES);
+    Store_field(res, 6, tmp);
+    CAMLreturn(res);
+}
+
+// external set_priority : t -> int -> unit = "caml_thread_set_priority"
+CAMLprim value caml_thread_set_priority(value descr, value priority) {
+    CAMLparam2(descr, priority);
+    long prio = Long_val(priority);
+    if (prio < 0 || prio >= THREAD_PRIORITIES) caml_invalid_argument("Thread.set_priority");
+    caml_thread_t th = Thread_val(descr);
+    // nothing to do for a finished thread
+    if (th != NULL) {
+	th->base_priority = prio;
+	thread_update_priority(th);
+	if (thread_outranked()) schedule();
+    }
+    CAMLreturn(Val_unit);
+}
+
+// external priority : t -> int = "caml_thread_priority"
+CAMLprim value caml_thread_priority(value descr) {
+    caml_thread_t th = Thread_val(descr);
+    return Val_long(th != NULL ? th->base_priority : 0);
+}
+
+/* Mutex.t and Condition.t are custom blocks pointing to the kernel
+ * object, it must not move while threads are queued on it.
+ */
+#define Mutex_val(v) (*((Mutex **) Data_custom_val(v)))
+#define Condition_val(v) (*((Condition **) Data_custom_val(v)))
+
+/* Waiters keep the mutex alive from caml_mutex_lock(), but it may still
+ * be locked: take it off its owner's held mutexes, which may lower the
+ * owner's priority, before it goes away.
+ */
+static void caml_mutex_finalize(value wrapper) {
+    Mutex *mutex = Mutex_val(wrapper);
+    caml_thread_t owner = mutex->owner;
+    if (owner != NULL) {
+	DLIST_REMOVE_FROM(&owner->held, mutex, held);
+	thread_update_priority(owner);
+    }
+    free(mutex);
+}
+
+static struct custom_operations caml_mutex_ops = {
+    .identifier = "_mutex",
+    .finalize = caml_mutex_finalize,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+};
+
+static void caml_condition_finalize(value wrapper) {
+    free(Condition_val(wrapper));
+}
+
+static struct custom_operations caml_condition_ops = {
+    .identifier = "_condition",
+    .finalize = caml_condition_finalize,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+};
+
+// external create : unit -> t = "caml_mutex_new"
+CAMLprim value caml_mutex_new(value unit) {
+    CAMLparam1(unit);
+    CAMLlocal1(wrapper);
+    Mutex *mutex = calloc(1, sizeof(Mutex));
+    if (mutex == NULL) caml_raise_out_of_memory();
+    wrapper = caml_alloc_custom(&caml_mutex_ops, sizeof(Mutex *), 0, 1);
+    Mutex_val(wrapper) = mutex;
+    CAMLreturn(wrapper);
+}
+
+// external lock : t -> unit = "caml_mutex_lock"
+CAMLprim value caml_mutex_lock(value wrapper) {
+    CAMLparam1(wrapper);
+    Mutex *mutex = Mutex_val(wrapper);
+    if (mutex->owner == curr_thread) caml_failwith("Mutex.lock: deadlock");
+    mutex_lock(mutex);
+    CAMLreturn(Val_unit);
+}
+
+// external try_lock : t -> bool = "caml_mutex_try_lock"
+CAMLprim value caml_mutex_try_lock(value wrapper) {
+    CAMLparam1(wrapper);
+    CAMLreturn(Val_bool(mutex_trylock(Mutex_val(wrapper))));
+}
+
+// external unlock : t -> unit = "caml_mutex_unlock"
+CAMLprim value caml_mutex_unlock(value wrapper) {
+    CAMLparam1(wrapper);
+    Mutex *mutex = Mutex_val(wrapper);
+    if (mutex->owner != curr_thread) caml_failwith("Mutex.unlock: not locked by this thread");
+    mutex_unlock(mutex);
+    if (thread_outranked()) schedule();
+    CAMLreturn(Val_unit);
+}
+
+// external create : unit -> t = "caml_condition_new"
+CAMLprim value caml_condition_new(value unit) {
+    CAMLparam1(unit);
+    CAMLlocal1(wrapper);
+    Condition *cond = calloc(1, sizeof(Condition));
+    if (cond == NULL) caml_raise_out_of_memory();
+    wrapper = caml_alloc_custom(&caml_condition_ops, sizeof(Condition *), 0, 1);
+    Condition_val(wrapper) = cond;
+    CAMLreturn(wrapper);
+}
+
+// external wait : t -> Mutex.t -> unit = "caml_condition_wait"
+CAMLprim value caml_condition_wait(value wcond, value wmutex) {
+    CAMLparam2(wcond, wmutex);
+    Mutex *mutex = Mutex_val(wmutex);
+    if (mutex->owner != curr_thread) caml_failwith("Condition.wait: mutex not locked by this thread");
+    condition_wait(Condition_val(wcond), mutex);
+    CAMLreturn(Val_unit);
+}
+
+// external timed_wait : t -> Mutex.t -> float -> bool = "caml_condition_timed_wait"
+CAMLprim value caml_condition_timed_wait(value wcond, value wmutex, value sec) {
+    CAMLparam3(wcond, wmutex, sec);
+    Mutex *mutex = Mutex_val(wmutex);
+    if (mutex->owner != curr_thread) caml_failwith("Condition.timed_wait: mutex not locked by this thread");
+    double d = Double_val(sec);
+    uint64_t time = time_now() + delay_us(d);
+    CAMLreturn(Val_bool(condition_wait_until(Condition_val(wcond), mutex, time)));
+}
+
+// external signal : t -> unit = "caml_condition_signal"
+CAMLprim value caml_condition_signal(value wrapper) {
+    CAMLparam1(wrapper);
+    thread_wakeup_one(&Condition_val(wrapper)->waiters);
+    if (thread_outranked()) schedule();
+    CAMLreturn(Val_unit);
+}
+
+// external broadcast : t -> unit = "caml_condition_broadcast"
+CAMLprim value caml_condition_broadcast(value wrapper) {
+    CAMLparam1(wrapper);
+    thread_wakeup_all(&Condition_val(wrapper)->waiters);
+    if (thread_outranked()) schedule();
+    CAMLreturn(Val_unit);
+}
@@ -1,26 +1,11 @@
 #include <stdint.h>
 #include "printf.h"
+#include "irq.h"
+#include "timer.h"
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
 #include <caml/alloc.h>
 
-enum {
-    // The base address for IRQs
-    IRQ_BASE = 0xE000B200,
-
-    // The offsets to reach registers for IRQs
-    IRQ_PENDING    = IRQ_BASE + 0x00,
-    IRQ_PENDING1   = IRQ_BASE + 0x04,
-    IRQ_PENDING2   = IRQ_BASE + 0x08,
-    IRQ_FIQCONTROL = IRQ_BASE + 0x0C,
-    IRQ_Enable     = IRQ_BASE + 0x18,
-    IRQ_Enable1    = IRQ_BASE + 0x10,
-    IRQ_Enable2    = IRQ_BASE + 0x14,
-    IRQ_Disable    = IRQ_BASE + 0x24,
-    IRQ_Disable1   = IRQ_BASE + 0x1C,
-    IRQ_Disable2   = IRQ_BASE + 0x20,
-};
-
 enum {
     // The base address for Timer.
     TIMER_BASE = 0xE0003000,
@@ -37,7 +22,6 @@ enum {
 
 enum {
     TICKS_PER_SEC = 1000000,
-    TICKS_PER_TOCK = 1000000,
 };
 
 enum {
@@ -52,18 +36,121 @@ enum Flags {
     _DUMMY = 1 << 31
 };
 
+/* Compare channel C1 is shared by the time slice of the running thread
+ * and the timer wheel: it is programmed for whichever ends first and the
+ * IRQ is off while neither is pending. The wheel ticks every
+ * 1 << TIMER_TICK_SHIFT us, timers expire on the first wheel tick at or
+ * after their time.
+ */
+enum {
+    TIMER_TICK_SHIFT = 10,
+    // closer matches could pass before C1 is written
+    TIMER_MIN_DELTA = 10,
+    // C1 compares the low word only
+    TIMER_MAX_DELTA = 1u << 31,
+};
+
+// time slice of the running thread in ticks (Thread_stubs.c)
+extern uint32_t thread_quantum;
+extern void thread_tick(void);
+
+static uint64_t slice_end;
+static int slice_active = 0;
+
+// low word of the free running counter, for measuring short intervals
+uint32_t time_ticks(void) {
+    return mmio_read(TIMER_CLO);
+}
+
+// the free running counter, in us since boot
+uint64_t time_now(void) {
+    uint32_t hi, lo;
+    do {
+	hi = mmio_read(TIMER_CHI);
+	lo = mmio_read(TIMER_CLO);
+    } while (hi != mmio_read(TIMER_CHI));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Program C1 for the end of the slice or the next wheel tick with work,
+ * with IRQs disabled. The match flag is write 1 to clear, writing MATCH1
+ * alone leaves the channels of the GPU alone.
+ */
+static void time_program(void) {
+    uint64_t next = slice_active ? slice_end : UINT64_MAX;
+    uint64_t tick = timer_next();
+    if (tick != UINT64_MAX && (tick << TIMER_TICK_SHIFT) < next) {
+	next = tick << TIMER_TICK_SHIFT;
+    }
+    if (next == UINT64_MAX) {
+	// nothing to wait for
+	irq_disable(IRQ_TIMER1);
+	mmio_write(TIMER_CS, MATCH1);
+	return;
+    }
+    uint64_t now = time_now();
+    if (next < now + TIMER_MIN_DELTA) next = now + TIMER_MIN_DELTA;
+    if (next > now + TIMER_MAX_DELTA) next = now + TIMER_MAX_DELTA;
+    mmio_write(TIMER_C1, (uint32_t)next);
+    mmio_write(TIMER_CS, MATCH1);
+    irq_enable(IRQ_TIMER1);
+}
+
+// start a new time slice: thread_tick() is called ticks from now
+void time_slice_start(uint32_t ticks) {
+    uint32_t cpsr = irq_save();
+    slice_end = time_now() + ticks;
+    slice_active = 1;
+    time_program();
+    irq_restore(cpsr);
+}
+
+// no other thread to share the CPU with, keep running
+void time_slice_stop(void) {
+    uint32_t cpsr = irq_save();
+    if (slice_active) {
+	slice_active = 0;
+	time_program();
+    }
+    irq_restore(cpsr);
+}
+
+// start a time slice unless one is running
+void time_slice_ensure(uint32_t ticks) {
+    uint32_t cpsr = irq_save();
+    if (!slice_active) time_slice_start(ticks);
+    irq_restore(cpsr);
+}
+
+/* Arm a timer to expire at time (us), its function runs in the timer IRQ
+ * with IRQs disabled.
+ */
+void time_timer_add(Timer *timer, uint64_t time) {
+    uint32_t cpsr = irq_save();
+    timer_add(timer, (time + (1u << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT);
+    time_program();
+    irq_restore(cpsr);
+}
+
+void time_timer_cancel(Timer *timer) {
+    uint32_t cpsr = irq_save();
+    if (timer_is_pending(timer)) {
+	timer_cancel(timer);
+	time_program();
+    }
+    irq_restore(cpsr);
+}
+
 // external init : unit -> unit = "ocaml_thread_init"
 CAMLprim value caml_time_init(value unit) {
     CAMLparam1(unit);
     printf("# ocaml_time_init()\n");
-    volatile uint32_t *ctrl = (uint32_t*)TIMER_CS;
-    volatile uint32_t *lo = (uint32_t*)TIMER_CLO;
-    volatile uint32_t *c1 = (uint32_t*)TIMER_C1;
-    volatile uint32_t *e1 = (uint32_t*)IRQ_Enable1;
-    *c1 = *lo + TICKS_PER_TOCK;
-    *ctrl |= MATCH1;
-    *e1 |= 2; // Timer 1
-    
+    // timers are placed relative to the wheel's time, start it now
+    uint32_t cpsr = irq_save();
+    timer_init(time_now() >> TIMER_TICK_SHIFT);
+    irq_restore(cpsr);
+    // the scheduler starts time slices once threads compete for the CPU
+
     CAMLreturn(Val_unit);
 }
 
@@ -71,9 +158,7 @@ CAMLprim value caml_time_init(value unit) {
 CAMLprim value caml_time_time(value unit) {
     CAMLparam1(unit);
     CAMLlocal1(res);
-    uint32_t hi = *((uint32_t*)TIMER_CHI);
-    uint32_t lo = *((uint32_t*)TIMER_CLO);
-    uint64_t t = (((uint64_t)hi) << 32) | lo;
+    uint64_t t = time_now();
     uint32_t tv_sec = t / TICKS_PER_SEC;
     uint32_t tv_usec = t % TICKS_PER_SEC;
     res = caml_alloc_tuple(2);
@@ -82,7 +167,6 @@ CAMLprim value caml_time_time(value unit) {
     CAMLreturn(res);
 }
 
-extern void caml_record_signal(int signal_number);
 /* FIXME: caml_young_limit should be in r10 but sometimes that causes a crash
 extern char * caml_code_area_start, * caml_code_area_end, *caml_young_limit, *caml_young_end;
 // 32 bits: Represent page table as a 2-level array
@@ -104,27 +188,22 @@ CAMLextern unsigned char * caml_page_table[Pagetable1_size];
    || (Classify_addr(pc) & In_code_area) )
 */
 
+/* The time slice ended or timers are due. thread_tick() only asks the
+ * running thread to switch at its next safe point: switching right here
+ * would leave the young heap pointers of interrupted OCaml code in the
+ * saved registers where the GC of the next thread can not see them.
+ * Timers waking up threads likewise only make them ready.
+ */
 void time_irq_timer1(uint32_t *regs) {
-    volatile uint32_t *ctrl = (uint32_t*)TIMER_CS;
-    uint32_t hi   = *(uint32_t*)TIMER_CHI;
-    uint32_t lo   = *(uint32_t*)TIMER_CLO;
-    volatile uint32_t *c1   = (uint32_t*)TIMER_C1;
-    uint32_t e    = *(uint32_t*)IRQ_Enable;
-    uint32_t e1   = *(uint32_t*)IRQ_Enable1;
-    uint32_t e2   = *(uint32_t*)IRQ_Enable2;
-    /*
-    printf("### enable  = %#x\n", e);
-    printf("### enable1 = %#x\n", e1);
-    printf("### enable2 = %#x\n", e2);
-    printf("### ctrl = %#x\n", *ctrl);
-    printf("### hi   = %#x\n", hi);
-    printf("### lo   = %#x\n", lo);
-    printf("### c1   = %#x\n", *c1);
-    */
-    *c1 += TICKS_PER_TOCK;
-    *ctrl |= MATCH1;
+    mmio_write(TIMER_CS, MATCH1);
+    uint64_t now = time_now();
+    if (slice_active && now >= slice_end) {
+	slice_active = 0;
+	thread_tick();
+    }
+    timer_advance(now >> TIMER_TICK_SHIFT);
+    time_program();
 //    printf("regs[10] = 0x%08x, caml_young_limit = %p, caml_young_end = %p, %s\n", regs[10], caml_young_limit, caml_young_end, Is_in_code_area(regs[15])?"ocaml":"C");
-    caml_record_signal(0);
 /* FIXME: caml_young_limit should be in r10 but sometimes that causes a crash
     if (Is_in_code_area(regs[15]))
       regs[10] = (uint32_t) caml_young_limit;
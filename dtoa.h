@@ -0,0 +1,81 @@
+/* dtoa.h - conversion between double and decimal strings
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * The digit generators take a finite v > 0 and fill digits with ASCII
+ * digits d1 d2 ... dn, without trailing zeros, so that the (rounded)
+ * value is 0.d1d2...dn * 10^decpt. They return n, which is 0 only when
+ * fixed rounding leaves nothing, e.g. 0.001 to 1 decimal, with decpt 1.
+ */
+
+#ifndef OCAML_RPI__DTOA_H
+#define OCAML_RPI__DTOA_H
+
+#include <stdint.h>
+
+/* A double has at most 767 significant decimal digits, more are never
+ * generated. dtoa_precision() and dtoa_decimals() need a buffer for all
+ * of them, a DtoaStream hands them out one at a time instead. Worst case
+ * stack use for output is then about 400 bytes for the DtoaStream, which
+ * holds the bignums, and 250 bytes of frames below it. strtod() keeps
+ * its larger bignums out of the stack.
+ */
+#define DTOA_DIGITS_MAX 800
+
+// words of the bignums behind exact digits, see exact_start()
+#define DTOA_WORDS 38
+
+typedef struct DtoaBig {
+    int len;
+    uint32_t *d;
+} DtoaBig;
+
+typedef struct DtoaStream {
+    DtoaBig r, s; // remainder and divisor of the long division
+    uint32_t r_words[DTOA_WORDS];
+    uint32_t s_words[DTOA_WORDS];
+    int decpt;
+    int left;     // digits still to divide out
+    int held;     // last digit below 9 not passed on yet, -1 for none
+    int nines;    // 9s divided out after it
+    int first;    // digit to pass on next, -1 for none
+    int fill;     // then this digit ...
+    int count;    // ... this many times
+    int done;     // rounded, nothing left to divide out
+    int pos;      // next of the n digits in buf, without exact digits
+    int n;
+    char buf[24];
+} DtoaStream;
+
+// shortest digits that read back as v, at most 17
+int dtoa_shortest(double v, char *digits, int *decpt);
+
+// v correctly rounded to ndigits significant digits
+int dtoa_precision(double v, int ndigits, char *digits, int *decpt);
+
+// v correctly rounded to ndecimals digits after the decimal point
+int dtoa_decimals(double v, int ndecimals, char *digits, int *decpt);
+
+/* Like dtoa_precision() or, with decimals set, dtoa_decimals(), but the
+ * digits come from dtoa_stream_next() in order, '0' past the n digits.
+ */
+int dtoa_stream_init(DtoaStream *st, double v, int count, int decimals, int *decpt);
+char dtoa_stream_next(DtoaStream *st);
+
+double strtod(const char *nptr, char **endptr);
+
+#endif // #ifndef OCAML_RPI__DTOA_H
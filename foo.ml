@@ -4,14 +4,84 @@ let rec fac = function
 
 let () = ignore (fac 10)
 let () = Printf.printf "Hello World\n%!"
-let handler num =
-  (* Printf.printf "Signal number %d\n%!" num;
-  *)
-   Thread.yield();
-  ()
-    
-let () = Sys.set_signal 0 (Sys.Signal_handle handler)
-  
+
+(* time Printf loops through write(): the UART ring takes 4k without
+   waiting, beyond that writers are held to the wire speed *)
+let () =
+  let line = String.make 63 '.' in
+  List.iter
+    (fun lines ->
+      let t0 = Time.time () in
+      for _i = 1 to lines do Printf.printf "%s\n" line done;
+      flush stdout;
+      let t1 = Time.time () in
+      let us = (t1.Time.tv_sec - t0.Time.tv_sec) * 1000000
+               + t1.Time.tv_usec - t0.Time.tv_usec in
+      Printf.printf "write: %d bytes in %d us\n%!" (lines * 64) us)
+    [16; 48; 256]
+
+(* producer/consumer through a one item buffer: waiting threads are
+   blocked, so each item costs two switches, to the consumer and back *)
+let () =
+  let m = Mutex.create () and c = Condition.create () in
+  let slot = ref None in
+  let items = 1000 in
+  let s0 = (Thread.stat ()).Thread.switches in
+  let consumer = Thread.create (fun () ->
+    for _i = 1 to items do
+      Mutex.lock m;
+      while !slot = None do Condition.wait c m done;
+      slot := None;
+      Condition.signal c;
+      Mutex.unlock m
+    done) in
+  for i = 1 to items do
+    Mutex.lock m;
+    while !slot <> None do Condition.wait c m done;
+    slot := Some i;
+    Condition.signal c;
+    Mutex.unlock m
+  done;
+  Thread.join consumer;
+  Printf.printf "producer/consumer: %d items, %d switches\n%!"
+    items ((Thread.stat ()).Thread.switches - s0)
+
+(* a thread per request: finished threads give back their descriptor
+   and stack, so this runs in constant memory *)
+let () =
+  let used () = (Memory.stat ()).Memory.used in
+  let before = used () in
+  for i = 1 to 1000 do
+    Thread.join (Thread.create ~stack_size:16384
+                   (fun () -> ignore (Printf.sprintf "request %d" i)))
+  done;
+  Printf.printf "thread per request: %d bytes used before, %d after, %d reaped\n%!"
+    before (used ()) (Thread.stat ()).Thread.reaped;
+  try Thread.join (Thread.create (fun () -> failwith "request failed"))
+  with Failure msg -> Printf.printf "join: Failure %S\n%!" msg
+
+(* sleepers sit in the timer wheel until their time comes, the timer
+   IRQ only fires for the next one due; a timed wait gives up unless
+   signaled in time *)
+let () =
+  let since t0 =
+    let t1 = Time.time () in
+    (t1.Time.tv_sec - t0.Time.tv_sec) * 1000000 + t1.Time.tv_usec - t0.Time.tv_usec in
+  let late = ref 0 in
+  let sleepers = Array.init 100 (fun i ->
+    Thread.create ~stack_size:16384 (fun () ->
+      let us = 1000 * (1 + i mod 50) in
+      let t0 = Time.time () in
+      Thread.delay (float us /. 1e6);
+      late := max !late (since t0 - us))) in
+  Array.iter Thread.join sleepers;
+  Printf.printf "delay: 100 sleepers, at most %d us late\n%!" !late;
+  let m = Mutex.create () and c = Condition.create () in
+  Mutex.lock m;
+  let signaled = Condition.timed_wait c m 0.01 in
+  Mutex.unlock m;
+  Printf.printf "timed_wait: %s\n%!" (if signaled then "signaled" else "timed out")
+
 let rec fib lst = function
   | 0 -> (1, "0", lst)
   | 1 -> (1, "1", lst)
@@ -44,15 +114,37 @@ let rec loop2 n =
 let t = Thread.create (fun () -> loop2 1)
 let t = Thread.create (fun () -> loop 1)
 
+(* type into the QEMU -serial stdio console to see stdin working; echo
+   runs above the fib loops, every IRQ wakes it to check for input *)
+let rec echo () =
+  let line = input_line stdin in
+  Printf.printf "echo: %s\n%!" line;
+  echo ()
+
+let t = Thread.create echo
+let () = Thread.set_priority t 24
+
+let print_latency () =
+  let stat = Thread.stat () in
+  Array.iteri
+    (fun prio count ->
+      if count > 0 then
+        Printf.printf "priority %d: %d wakeups, latency mean %d us, max %d us\n"
+          prio count stat.Thread.latency_mean.(prio) stat.Thread.latency_max.(prio))
+    stat.Thread.latency_count
+
 let rec loop3 n =
   Printf.printf "[%s] loop3 %d\n%!" (Time.to_string (Time.time ())) n;
-  Thread.yield ();
+  Thread.delay 1.0;
 (*
   Gc.major ();
   Gc.compact ();
 *)  let stat = Gc.stat ()
   in
   Printf.printf "live_words = %d\n%!" stat.Gc.live_words;
+  Memory.print (Memory.stat ());
+  print_latency ();
+  flush stdout;
   loop3 (n+1)
 
 let () =
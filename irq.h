@@ -0,0 +1,88 @@
+/* irq.h - interrupt controller and IRQ masking
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Reference material:
+ * http://www.raspberrypi.org/wp-content/uploads/2012/02/BCM2835-ARM-Peripherals.pdf
+ * Chapter 7: Interrupts
+ *
+ * GPU interrupts 0-31 show up in IRQ_PENDING1, 32-63 in IRQ_PENDING2.
+ * exception_irq_handler() in main.c reads both and calls the drivers.
+ */
+
+#ifndef OCAML_RPI__IRQ_H
+#define OCAML_RPI__IRQ_H
+
+#include <stdint.h>
+#include "mmio.h"
+
+enum {
+    // The base address for IRQs
+    IRQ_BASE = 0xE000B200,
+
+    // The offsets to reach registers for IRQs
+    IRQ_PENDING    = IRQ_BASE + 0x00,
+    IRQ_PENDING1   = IRQ_BASE + 0x04,
+    IRQ_PENDING2   = IRQ_BASE + 0x08,
+    IRQ_FIQCONTROL = IRQ_BASE + 0x0C,
+    IRQ_Enable     = IRQ_BASE + 0x18,
+    IRQ_Enable1    = IRQ_BASE + 0x10,
+    IRQ_Enable2    = IRQ_BASE + 0x14,
+    IRQ_Disable    = IRQ_BASE + 0x24,
+    IRQ_Disable1   = IRQ_BASE + 0x1C,
+    IRQ_Disable2   = IRQ_BASE + 0x20,
+};
+
+// GPU interrupt numbers
+enum {
+    IRQ_TIMER1 = 1,
+    IRQ_UART = 57,
+};
+
+// enable a GPU interrupt in the interrupt controller
+static inline void irq_enable(unsigned irq) {
+    mmio_write(irq < 32 ? IRQ_Enable1 : IRQ_Enable2, 1u << (irq & 31));
+}
+
+// disable a GPU interrupt in the interrupt controller
+static inline void irq_disable(unsigned irq) {
+    mmio_write(irq < 32 ? IRQ_Disable1 : IRQ_Disable2, 1u << (irq & 31));
+}
+
+// disable IRQs, returning the old state
+static inline uint32_t irq_save(void) {
+    uint32_t cpsr;
+    asm volatile("mrs %[cpsr], cpsr; cpsid i" : [cpsr]"=r"(cpsr) : : "memory");
+    return cpsr;
+}
+
+static inline void irq_restore(uint32_t cpsr) {
+    asm volatile("msr cpsr_c, %[cpsr]" : : [cpsr]"r"(cpsr) : "memory");
+}
+
+// enable IRQs, e.g. in a new thread that was switched to with IRQs off
+static inline void irq_unmask(void) {
+    asm volatile("cpsie i" : : : "memory");
+}
+
+// sleep until an interrupt is pending, works with IRQs disabled so the
+// caller can check for work and sleep without losing a wakeup
+static inline void irq_wait(void) {
+    asm volatile("mcr p15, 0, %[zero], c7, c0, 4" : : [zero]"r"(0) : "memory");
+}
+
+#endif // #ifndef OCAML_RPI__IRQ_H
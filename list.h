@@ -79,6 +79,16 @@ static inline void dlist_push(DList **d1p, DList *d2) {
     *d1p = d2;
 }
 
+// append d2 to the back of the d1p list
+static inline void dlist_append(DList **d1p, DList *d2) {
+//    printf("%s(%p, %p)\n", __FUNCTION__, d1p, d2);
+    if (*d1p != NULL) {
+	dlist_insert_before(*d1p, d2);
+    } else {
+	*d1p = d2;
+    }
+}
+
 // pop the front of the dp list
 static inline DList * dlist_pop(DList **dp) {
 //    printf("%s(%p)\n", __FUNCTION__, dp);
@@ -129,6 +139,15 @@ static inline void dlist_remove_from(DList **d1p, DList *d2) {
 	*h_ = CONTAINER(typeof(*v), l, head);				\
     }
 
+#define DLIST_APPEND(h, v, l)						\
+    {									\
+	typeof(*v) **h_ = h, *v_ = v;					\
+	DList *head = &(*h_)->l;					\
+	if (*h_ == NULL) head = NULL;					\
+	dlist_append(&head, &v_->l);					\
+	*h_ = CONTAINER(typeof(*v), l, head);				\
+    }
+
 #define DLIST_POP(h, l)							\
     ({									\
 	typeof(**h) **h_ = h;						\
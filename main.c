@@ -1,16 +1,22 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <time.h>
 
+#include "mmio.h"
+#include "irq.h"
 #include "uart.h"
 #include "printf.h"
 #include "string.h"
 #include "memory.h"
+#include "trace.h"
 
 #define UNUSED(x) (void)(x)
 
 // error
 int errno;
+#define EBADF 9
+#define EAGAIN 11
 #define EINVAL 22
 #define ERANGE 34
 
@@ -98,7 +104,11 @@ void kernel_main(int zero, int model, void *atags) {
     printf("atags @ %p\n", atags);
     uint32_t mem_size = ((uint32_t*)atags)[7];
     printf("memory size = %#x\n", mem_size);
-    memory_init(_end, mem_size - ((intptr_t)_end - 0xC0000000));
+    {
+	// boot.S only clears the bss, the heap holds whatever was left
+	size_t heap_size = mem_size - ((intptr_t)_end - 0xC0000000);
+	memory_init(_end, heap_size, 0);
+    }
     {
 	char c;
 	printf("# stack = %p\n", &c);
@@ -131,134 +141,134 @@ void kernel_main(int zero, int model, void *atags) {
  * math functions                                                          *
  ***************************************************************************/
 double acos(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n");
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double asin(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n");
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double atan(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double atan2(double y, double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(y);
     return 0;
 }
 double ceil(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double cos(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double cosh(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double exp(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double expm1(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double floor(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double fmod(double x, double y) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(y);
     return 0;
 }
 double frexp(double x, int *expo) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(expo);
     return 0;
 }
 double hypot(double x, double y) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(y);
     return 0;
 }
 double ldexp(double x, int expo) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(expo);
     return 0;
 }
 double log(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double log10(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double log1p(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double modf(double x, double *iptr) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(iptr);
     return 0;
 }
 double pow(double x, double y) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     UNUSED(y);
     return 0;
 }
 double sin(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double sinh(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double sqrt(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double tan(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 double tanh(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
 int __fpclassify(double x) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(x);
     return 0;
 }
@@ -278,50 +288,83 @@ FILE stdout = { .fd = 1 };
 FILE stderr = { .fd = 2 };
 
 int fflush(FILE *stream) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(stream);
     return 0;
 }
 
 int fputc(int c, FILE *stream) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(stream);
     return putchar(c);
 }
 
 int fputs(const char *s, FILE *stream) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(stream);
     return puts(s);
 }
 
+// file status flags of stdin, stdout and stderr, set with fcntl()
+#define O_NONBLOCK 04000
+int fd_flags[3];
+
+// Thread_stubs.c
+extern void thread_wait(int (*ready)(void));
+
+static int stdout_ready(void) {
+    return uart_write_ready();
+}
+
+// stdout and stderr are the UART, hand it whole buffers
 ssize_t write(int fd, const void *buf, size_t count) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
-    UNUSED(fd);
-    size_t n = count;
+    TRACE_DEBUG("%s(fd = %d, count = %zd)", __FUNCTION__, fd, count);
+    if (fd != 1 && fd != 2) {
+	errno = EBADF;
+	return -1;
+    }
     const char *p = (const char *)buf;
-    while(n-- > 0) putchar(*p++);
-    return count;
+    size_t done = 0;
+    while(1) {
+	done += uart_write(p + done, count - done);
+	if (done == count || (fd_flags[fd] & O_NONBLOCK)) break;
+	thread_wait(stdout_ready);
+    }
+    if (done == 0 && count > 0) {
+	errno = EAGAIN;
+	return -1;
+    }
+    return done;
 }
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
-    UNUSED(stream);
-    size *= nmemb;
-    size_t n = size;
-    const char *p = (const char *)ptr;
-    while(n-- > 0) putchar(*p++);
-    return size;
+    TRACE_DEBUG("%s()", __FUNCTION__);
+    if (size == 0) return 0;
+    ssize_t res = write(stream->fd, ptr, size * nmemb);
+    return res < 0 ? 0 : res / size;
 }
 
+static int stdin_ready(void) {
+    return uart_poll();
+}
+
+// stdin is the UART, wait for at least one byte
 ssize_t read(int fd, void *buf, size_t count) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
-    UNUSED(fd);
-    UNUSED(buf);
-    UNUSED(count);
-    // FIXME: read from uart
-    panic("MISSING: read()");
-    return -1;
+    TRACE_DEBUG("%s(fd = %d, count = %zd)", __FUNCTION__, fd, count);
+    if (fd != 0) {
+	errno = EBADF;
+	return -1;
+    }
+    if (count == 0) return 0;
+    while(1) {
+	size_t n = uart_read((char *)buf, count);
+	if (n > 0) return n;
+	if (fd_flags[fd] & O_NONBLOCK) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	thread_wait(stdin_ready);
+    }
 }
 
 // exit
@@ -332,13 +375,13 @@ void __attribute__((noreturn)) exit(int status) {
 
 // filesystem
 int chdir(const char *path) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(path);
     return -1;
 }
 
 int close(int fd) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(fd);
     return 0;
 }
@@ -346,20 +389,37 @@ int close(int fd) {
 typedef struct DIR { } DIR;
 
 int closedir(DIR *dirp) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(dirp);
     return 0;
 }
 
+#define F_GETFL 3
+#define F_SETFL 4
 int fcntl(int fd, int cmd, ... /* arg */ ) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
-    UNUSED(fd);
-    UNUSED(cmd);
-    return -1;
+    TRACE_DEBUG("%s(fd = %d, cmd = %d)", __FUNCTION__, fd, cmd);
+    if (fd < 0 || fd > 2) {
+	errno = EBADF;
+	return -1;
+    }
+    switch(cmd) {
+    case F_GETFL:
+	return fd_flags[fd];
+    case F_SETFL: {
+	va_list args;
+	va_start(args, cmd);
+	fd_flags[fd] = va_arg(args, int) & O_NONBLOCK;
+	va_end(args);
+	return 0;
+    }
+    default:
+	errno = EINVAL;
+	return -1;
+    }
 }
 
 char *getcwd(char *buf, size_t size) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(size);
     buf[0] = '/';
     buf[1] = 0;
@@ -369,7 +429,7 @@ char *getcwd(char *buf, size_t size) {
 //typedef uint64_t off_t;
 
 off_t lseek64(int fd, off_t offset, int whence) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(fd);
     UNUSED(offset);
     UNUSED(whence);
@@ -378,7 +438,7 @@ off_t lseek64(int fd, off_t offset, int whence) {
 
 // typedef int mode_t;
 int open64(const char *pathname, int flags, mode_t mode) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(pathname);
     UNUSED(flags);
     UNUSED(mode);
@@ -386,7 +446,7 @@ int open64(const char *pathname, int flags, mode_t mode) {
 }
 
 DIR *opendir(const char *name) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(name);
     return NULL;
 }
@@ -394,13 +454,13 @@ DIR *opendir(const char *name) {
 struct dirent;
 
 struct dirent *readdir64(DIR *dirp) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(dirp);
     return NULL;
 }
 
 ssize_t readlink(const char *path, char *buf, size_t bufsiz) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(path);
     UNUSED(buf);
     UNUSED(bufsiz);
@@ -408,14 +468,14 @@ ssize_t readlink(const char *path, char *buf, size_t bufsiz) {
 }
 
 int rename(const char *oldpath, const char *newpath) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(oldpath);
     UNUSED(newpath);
     return -1;
 }
 
 int unlink(const char *pathname) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(pathname);
     return -1;
 }
@@ -423,7 +483,7 @@ int unlink(const char *pathname) {
 struct stat;
 
 int __xstat64(const char *path, struct stat *buf) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(path);
     UNUSED(buf);
     return -1;
@@ -431,7 +491,7 @@ int __xstat64(const char *path, struct stat *buf) {
 
 // processes
 char *getenv(const char *name) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(name);
     return NULL;
 }
@@ -439,19 +499,19 @@ char *getenv(const char *name) {
 typedef int pid_t;
 
 pid_t getpid(void) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     return 1;
 }
 
 pid_t getppid(void) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     return 0;
 }
 
 struct rlimit;
 
 int getrlimit(int resource, struct rlimit *rlim) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(resource);
     UNUSED(rlim);
     return -1;
@@ -460,7 +520,7 @@ int getrlimit(int resource, struct rlimit *rlim) {
 struct rusage;
 
 int getrusage(int who, struct rusage *usage) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(who);
     UNUSED(usage);
     return -1;
@@ -471,22 +531,46 @@ struct timeval;
 struct timezone;
 
 int gettimeofday(struct timeval *tv, struct timezone *tz) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(tv);
     UNUSED(tz);
     return -1;
 }
 
+// Thread_stubs.c
+extern void thread_sleep(uint64_t usec);
+
+// sleep in the timer wheel, behind Unix.sleep and Unix.sleepf
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    TRACE_DEBUG("%s()", __FUNCTION__);
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+	errno = EINVAL;
+	return -1;
+    }
+    thread_sleep((uint64_t)req->tv_sec * 1000000 + (req->tv_nsec + 999) / 1000);
+    if (rem != NULL) {
+	rem->tv_sec = 0;
+	rem->tv_nsec = 0;
+    }
+    return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+    TRACE_DEBUG("%s()", __FUNCTION__);
+    thread_sleep((uint64_t)seconds * 1000000);
+    return 0;
+}
+
 // locale
 char *setlocale(int category, const char *locale) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(category);
     UNUSED(locale);
     return NULL;
 }
 
 const unsigned short **__ctype_b_loc (void) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     static const unsigned short *ctypes[384];
     return &ctypes[128];
 }
@@ -496,7 +580,7 @@ const unsigned short **__ctype_b_loc (void) {
 
 int sigaction(int signum, const struct sigaction *act,
 	      struct sigaction *oldact) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(signum);
     UNUSED(act);
     UNUSED(oldact);
@@ -510,7 +594,7 @@ int sigaction(int signum, const struct sigaction *act,
 // typedef struct { } sigset_t;
 
 int sigaddset(sigset_t *set, int signum) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(set);
     UNUSED(signum);
     return -1;
@@ -518,40 +602,33 @@ int sigaddset(sigset_t *set, int signum) {
 
 int sigaltstack (const struct sigaltstack *__restrict ss,
 		 struct sigaltstack *__restrict oss) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(ss);
     UNUSED(oss);
     return -1;
 }
 
 int sigdelset(sigset_t *set, int signum) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(set);
     UNUSED(signum);
     return -1;
 }
 
 int sigemptyset(sigset_t *set) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(set);
     return -1;
 }
 
 int sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(how);
     UNUSED(set);
     UNUSED(oldset);
     return -1;
 }
 
-double strtod(const char *nptr, char **endptr) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
-    UNUSED(nptr);
-    UNUSED(endptr);
-    return 0.0;
-}
-
 int isspace(int c) {
     switch(c) {
     case '\f':
@@ -708,19 +785,19 @@ long int strtol(const char *nptr, char **endptr, int base) {
 }
 
 int * __errno_location(void) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     return &errno;
 }
 
 char *strerror(int errnum) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(errnum);
     return NULL;
 }
 
 // system
 int system(const char *command) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(command);
     return -1;
 }
@@ -729,7 +806,7 @@ int system(const char *command) {
 void * __stack_chk_guard = NULL;
  
 void __stack_chk_guard_setup(void) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     int * p;
     p = (int *) &__stack_chk_guard;
  
@@ -745,7 +822,7 @@ void __attribute__((noreturn)) __stack_chk_fail(void) {
 // printf / scanf
 
 int __sprintf_chk(char * str, int flag, size_t len, const char * format, ...) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); //delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(flag);
     va_list args;
 
@@ -756,58 +833,64 @@ int __sprintf_chk(char * str, int flag, size_t len, const char * format, ...) {
     return len;
 }
 
-#define BUF_SIZE 4096
 int sprintf(char * str, const char * format, ...) {
-    // puts("# "); puts(__FUNCTION__); puts("()\n"); //delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     va_list args;
     size_t len;
 
+    // the caller promises str is large enough
     va_start(args, format);
-    len = vsnprintf(str, BUF_SIZE, format, args);
+    len = vsnprintf(str, SIZE_MAX, format, args);
     va_end(args);
 
     return len;
 }
 
+// stream the output of fprintf() to the file descriptor
+typedef struct FdSink {
+    Sink sink;
+    int fd;
+} FdSink;
+
+static void fd_sink_write(Sink *sink, const char *buf, size_t len) {
+    FdSink *out = (FdSink *)sink;
+    while(len > 0) {
+	ssize_t n = write(out->fd, buf, len);
+	if (n <= 0) return;
+	buf += n;
+	len -= n;
+    }
+}
+
+int vfprintf(FILE * stream, const char * format, va_list args) {
+    TRACE_DEBUG("%s()", __FUNCTION__);
+    FdSink out = { { fd_sink_write }, stream->fd };
+    return vsprintf_sink(&out.sink, format, args);
+}
+
 int __fprintf_chk(FILE * stream, int flag, const char * format, ...) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); //delay(100000000);
-    UNUSED(stream);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(flag);
     va_list args;
-    char buf[BUF_SIZE];
     ssize_t len;
     va_start(args, format);
-    len = vsnprintf(buf, BUF_SIZE, format, args);
+    len = vfprintf(stream, format, args);
     va_end(args);
-    if (len != -1 && len <= BUF_SIZE) {
-	puts(buf);
-    } else {
-	// FIXME: too long
-	panic("printf: too long\n");
-    }
     return len;
 }
 
 int fprintf(FILE * stream, const char * format, ...) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); //delay(100000000);
-    UNUSED(stream);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     va_list args;
-    char buf[BUF_SIZE];
     ssize_t len;
     va_start(args, format);
-    len = vsnprintf(buf, BUF_SIZE, format, args);
+    len = vfprintf(stream, format, args);
     va_end(args);
-    if (len != -1 && len <= BUF_SIZE) {
-	puts(buf);
-    } else {
-	// FIXME: too long
-	panic("printf: too long\n");
-    }
     return len;
 }
 
 int __isoc99_sscanf(const char *format, ...) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_ERROR("%s()", __FUNCTION__);
     UNUSED(format);
     return -1;
 }
@@ -816,7 +899,7 @@ int __isoc99_sscanf(const char *format, ...) {
 typedef struct { } sigjmp_buf;
 
 int __sigsetjmp(sigjmp_buf env, int savesigs) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(env);
     UNUSED(savesigs);
     return 0;
@@ -836,25 +919,25 @@ void __aeabi_unwind_cpp_pr0(void) {
  * dl functions                                                            *
  ***************************************************************************/
 void *dlopen(const char *filename, int flag) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(filename);
     UNUSED(flag);
     return 0;
 }
 
 int dlclose(void *handle) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(handle);
     return -1;
 }
 
 const char *dlerror(void) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     return "ERROR: dlerror()\n";
 }
 
 void *dlsym(void *handle, const char *symbol) {
-    puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
+    TRACE_DEBUG("%s()", __FUNCTION__);
     UNUSED(handle); UNUSED(symbol);
     return 0;
 }
@@ -873,42 +956,53 @@ void dump(uint32_t *regs) {
 	printf("%s = %#8.8x    ", name[i], regs[i]);
     }
     putchar('\n');
+    trace_dump();
 }
 
 void exception_reset_handler(uint32_t *regs) {
+    uart_sync();
     puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
     dump(regs);
 }
 
 void exception_undefined_handler(uint32_t *regs) {
+    uart_sync();
     puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
     dump(regs);
 }
 
 void exception_syscall_handler(uint32_t *regs) {
+    uart_sync();
     puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
     dump(regs);
 }
 
 void exception_prefetch_abort_handler(uint32_t *regs) {
+    uart_sync();
     puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
     dump(regs);
 }
 
 void exception_data_abort_handler(uint32_t *regs) {
+    uart_sync();
     puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
     dump(regs);
 }
 
 extern void time_irq_timer1(uint32_t *regs);
+extern void thread_irq(void);
 void exception_irq_handler(uint32_t *regs) {
-    UNUSED(regs);
-    puts("# "); puts(__FUNCTION__); puts("()\n");
-//    dump(regs);
-    time_irq_timer1(regs);
+    uint32_t pending1 = mmio_read(IRQ_PENDING1);
+    uint32_t pending2 = mmio_read(IRQ_PENDING2);
+    TRACE_DEBUG("%s(pending1 = %#x, pending2 = %#x)", __FUNCTION__, pending1, pending2);
+    if (pending1 & (1u << IRQ_TIMER1)) time_irq_timer1(regs);
+    if (pending2 & (1u << (IRQ_UART - 32))) uart_irq();
+    // threads in thread_wait() check again
+    thread_irq();
 }
 
 void exception_fiq_handler(uint32_t *regs) {
+    uart_sync();
     puts("# "); puts(__FUNCTION__); puts("()\n"); delay(100000000);
     dump(regs);
 }
@@ -24,175 +24,653 @@
 #include "list.h"
 #include "printf.h"
 #include "string.h"
+#include "memory.h"
 
 void delay(uint32_t);
 
+/* Allocation trace
+ * Build with -DMEMORY_TRACE to log every malloc, free, realloc and
+ * memalign as a "#T" line on the console. test/memory replays those.
+ */
+#ifdef MEMORY_TRACE
+#define TRACE(fmt, ...) printf("#T " fmt "\n", ##__VA_ARGS__)
+#else
+#define TRACE(fmt, ...) do { } while(0)
+#endif
+
+#ifndef ENOMEM
+#define ENOMEM 12
+#endif
+#ifndef EINVAL
+#define EINVAL 22
+#endif
+
+/* Chunks use boundary tags
+ *
+ * The only metadata of an allocated chunk is the size word in front of
+ * the data. It holds the size of the whole chunk with the CHUNK_USED and
+ * CHUNK_PREV_FREE flags folded into the low bits. A free chunk links into
+ * the tree of its free slot through the data and repeats its size in the
+ * last word, so free() can find a free predecessor without any walking.
+ */
 typedef struct Chunk Chunk;
 struct Chunk {
-    DList all;
-    int used;
+    size_t size; // must be the word right before data, see memory_is_chunk()
     union {
 	char data[0];
-	DList free;
+	Chunk *child[2]; // free: subtrees of the chunks sorting before and after
     };
 };
 
 enum {
-    NUM_SIZES = 32,
+    CHUNK_USED = 1,
+    CHUNK_PREV_FREE = 2,
+    CHUNK_FLAGS = CHUNK_USED | CHUNK_PREV_FREE,
+    NUM_SIZES = MEMORY_NUM_SLOTS,
+    NUM_SUB_BITS = 3,
+    NUM_SUB = 1 << NUM_SUB_BITS, // sub slots per slot
     ALIGN = __alignof__(Chunk),
-    MIN_SIZE = sizeof(DList),
+    LINKS_SIZE = 2 * sizeof(Chunk*),
+    MIN_SIZE = LINKS_SIZE + sizeof(size_t), // room for child and footer
     HEADER_SIZE = OFFSETOF(Chunk, data),
 };
 
-Chunk *free_chunk[NUM_SIZES] = { NULL };
+_Static_assert(ALIGN > CHUNK_FLAGS, "ALIGN leaves no room for the flags");
+
+/* Slab caches for small objects
+ *
+ * Allocations up to SLAB_MAX bytes are rounded up to one of the size
+ * classes in slab_class_size[] and served from SLAB_SIZE pages carved
+ * from the chunk allocator. Every object is preceded by a single word
+ * pointing back to its Slab. Allocated chunks always have an odd word
+ * (size | CHUNK_USED) in that place so free() can tell the two apart.
+ */
+typedef struct Slab Slab;
+struct Slab {
+    DList partial; // link in SlabCache.partial while not full
+    void *free;    // singly linked list of freed objects
+    char *fresh;   // next never used object
+    char *end;     // end of the slab page
+    size_t used;   // number of objects handed out
+    int cls;       // size class
+};
+
+typedef struct SlabCache {
+    Slab *partial; // slabs with free objects
+    size_t size;   // object size
+    size_t stride; // object size including back pointer, aligned
+} SlabCache;
+
+enum {
+    SLAB_SIZE = 16384,
+    SLAB_GRANULE = 16,
+    SLAB_MAX = 512,
+    SLAB_HEADER = sizeof(Slab*),
+    NUM_SLAB_CLASSES = MEMORY_NUM_SLAB_CLASSES,
+};
+
+const size_t slab_class_size[NUM_SLAB_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+SlabCache slab_cache[NUM_SLAB_CLASSES];
+uint8_t slab_class[SLAB_MAX / SLAB_GRANULE + 1];
+
+Chunk *free_chunk[NUM_SIZES][NUM_SUB] = { { NULL } }; // tree roots
+uint32_t free_bitmap = 0; // bit n is set while free_chunk[n][] has a chunk
+uint8_t free_sub_bitmap[NUM_SIZES] = { 0 }; // bit s for free_chunk[n][s]
 size_t mem_free = 0;
 size_t mem_used = 0;
 size_t mem_meta = 0;
+MemoryStats mem_stats;
 Chunk *first = NULL;
-Chunk *last = NULL;
+Chunk *last = NULL; // end marker, always used and never merged
+char *mem_top = NULL; // nothing from here on was handed out, see memory_hand_out()
 
-void memory_chunk_init(Chunk *chunk) {
+size_t memory_chunk_size(const Chunk *chunk) {
 //    printf("%s(%p)\n", __FUNCTION__, chunk);
-    DLIST_INIT(chunk, all);
-    chunk->used = 0;
-    DLIST_INIT(chunk, free);
+    return (chunk->size & ~CHUNK_FLAGS) - HEADER_SIZE;
 }
 
-size_t memory_chunk_size(const Chunk *chunk) {
-//    printf("%s(%p)\n", __FUNCTION__, chunk);
-    char *end = (char*)(chunk->all.next);
-    char *start = (char*)(&chunk->all);
-    return (end - start) - HEADER_SIZE;
+Chunk *memory_chunk_next(const Chunk *chunk) {
+    return (Chunk*)((intptr_t)chunk + (chunk->size & ~CHUNK_FLAGS));
 }
 
+// only valid if CHUNK_PREV_FREE is set
+Chunk *memory_chunk_prev(const Chunk *chunk) {
+    return (Chunk*)((intptr_t)chunk - (((const size_t*)chunk)[-1] & ~CHUNK_FLAGS));
+}
+
+/* Fresh memory
+ *
+ * Nothing from mem_top up to the end of the heap was handed out since
+ * memory_init(). If memory_init() is told the heap is zero it stays zero
+ * there, apart from the links and footer of the free chunk at the top,
+ * so calloc() only clears what lies below mem_top and nobody has to
+ * clear the heap up front. Otherwise mem_top starts at the end and no
+ * memory is fresh. Handing out a chunk moves mem_top past it and the
+ * header and links of the free chunk split off behind it, so the only
+ * metadata ever written above mem_top is the footer of the top chunk.
+ */
+void memory_hand_out(const Chunk *chunk) {
+    char *top = (char*)memory_chunk_next(chunk) + HEADER_SIZE + LINKS_SIZE;
+    if (top > mem_top) mem_top = top;
+}
+
+// index of the highest set bit, -1 for 0
 int memory_chunk_slot(size_t size) {
-    int n = -1;
-    while(size > 0) {
-	++n;
-	size /= 2;
+    if (size == 0) return -1;
+    return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size);
+}
+
+/* Free slots are split into NUM_SUB sub slots by the bits below the
+ * highest one, each a tree sorted by size and then by address.
+ *
+ * Allocation takes the first chunk that fits, which makes it an address
+ * ordered best fit. Small requests chip away at small chunks low in
+ * memory and the big chunks stay whole for when the heap grows.
+ *
+ * The trees are treaps: on top of the search order every chunk ranks
+ * below its parent by a hash of its address. That keeps them balanced
+ * in expectation whatever order chunks come and go in, so inserting,
+ * removing and finding a best fit take O(log n) without storing any
+ * balance information in the two words of links a free chunk has.
+ */
+int memory_chunk_sub(size_t size, int n) {
+    if (n < NUM_SUB_BITS) return 0;
+    return (size >> (n - NUM_SUB_BITS)) & (NUM_SUB - 1);
+}
+
+int memory_chunk_before(const Chunk *a, const Chunk *b) {
+    size_t sa = a->size & ~CHUNK_FLAGS, sb = b->size & ~CHUNK_FLAGS;
+    return (sa < sb) || (sa == sb && a < b);
+}
+
+// treap rank, the bits of the address mixed up
+uint32_t memory_chunk_rank(const Chunk *chunk) {
+    uint32_t h = (uint32_t)((uintptr_t)chunk / ALIGN);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// add chunk to the tree at *link
+void memory_tree_insert(Chunk **link, Chunk *chunk) {
+    uint32_t rank = memory_chunk_rank(chunk);
+    while (*link != NULL && memory_chunk_rank(*link) > rank) {
+	link = &(*link)->child[memory_chunk_before(*link, chunk)];
     }
-    return n;
+    // chunk takes this place, the subtree splits into its children
+    Chunk *rest = *link;
+    Chunk **before = &chunk->child[0], **after = &chunk->child[1];
+    while (rest != NULL) {
+	if (memory_chunk_before(rest, chunk)) {
+	    *before = rest;
+	    before = &rest->child[1];
+	    rest = rest->child[1];
+	} else {
+	    *after = rest;
+	    after = &rest->child[0];
+	    rest = rest->child[0];
+	}
+    }
+    *before = NULL;
+    *after = NULL;
+    *link = chunk;
 }
 
-void memory_init(void *mem, size_t size) {
-    first = (Chunk*)(((intptr_t)mem + ALIGN - 1) & (~(ALIGN - 1)));
-    last = ((Chunk*)(((intptr_t)mem + size) & (~(ALIGN - 1)))) - 1;
-    Chunk *second = first + 1;
-    memory_chunk_init(first);
-    memory_chunk_init(second);
-    memory_chunk_init(last);
-    dlist_insert_after(&first->all, &second->all);
-    dlist_insert_after(&second->all, &last->all);
-    // mark first/last as used so they never get merged
-    first->used = 1;
-    last->used = 1;
-
-    size_t len = memory_chunk_size(second);
-    int n = memory_chunk_slot(len);
-    printf("%s(%p, %#zx) : adding chunk %#zx [%d]\n", __FUNCTION__, mem, size, len, n);
-    DLIST_PUSH(&free_chunk[n], second, free);
-    mem_free = len - HEADER_SIZE;
-    mem_meta = sizeof(Chunk) * 2 + HEADER_SIZE;
+// take chunk out of the tree at *link, its size must not have changed
+void memory_tree_remove(Chunk **link, Chunk *chunk) {
+    while (*link != chunk) {
+	link = &(*link)->child[memory_chunk_before(*link, chunk)];
+    }
+    // merge the children into its place
+    Chunk *before = chunk->child[0], *after = chunk->child[1];
+    while (before != NULL && after != NULL) {
+	if (memory_chunk_rank(before) > memory_chunk_rank(after)) {
+	    *link = before;
+	    link = &before->child[1];
+	    before = before->child[1];
+	} else {
+	    *link = after;
+	    link = &after->child[0];
+	    after = after->child[0];
+	}
+    }
+    *link = (before != NULL) ? before : after;
 }
 
-void *malloc(size_t size) {
-    printf("%s(%#zx)\n", __FUNCTION__, size);
-    size = (size + ALIGN - 1) & (~(ALIGN - 1));
-    if (size < MIN_SIZE) size = MIN_SIZE;
-    int n = memory_chunk_slot(size - 1) + 1;
-    if (n >= NUM_SIZES) return NULL;
-    while(!free_chunk[n]) {
-	++n;
-	if (n >= NUM_SIZES) return NULL;
-    }
-    Chunk *chunk = DLIST_POP(&free_chunk[n], free);
-    size_t size2 = memory_chunk_size(chunk);
-//    printf("@ %p [%#zx]\n", chunk, size2);
-    size_t len = 0;
-    if (size + sizeof(Chunk) <= size2) {
-	Chunk *chunk2 = (Chunk*)((intptr_t)chunk + HEADER_SIZE + size);
-	memory_chunk_init(chunk2);
-	dlist_insert_after(&chunk->all, &chunk2->all);
-	len = memory_chunk_size(chunk2);
-	n = memory_chunk_slot(len);
-//	printf("  adding chunk @ %p %#zx [%d]\n", chunk2, len, n);
-	DLIST_PUSH(&free_chunk[n], chunk2, free);
-	mem_meta += HEADER_SIZE;
-	mem_free += len - HEADER_SIZE;
+// smallest chunk of at least size bytes in a tree, lowest among equals
+Chunk *memory_tree_fit(Chunk *root, size_t size) {
+    Chunk *best = NULL;
+    while (root != NULL) {
+	if (memory_chunk_size(root) >= size) {
+	    best = root;
+	    root = root->child[0];
+	} else {
+	    root = root->child[1];
+	}
     }
-    chunk->used = 1;
-    mem_free -= size2;
-    mem_used += size2 - len - HEADER_SIZE;
-    printf("  = %p [%p]\n", chunk->data, chunk);
-    return chunk->data;
+    return best;
 }
 
+// take chunk out of its free slot, the caller updates the flags
 void remove_free(Chunk *chunk) {
     size_t len = memory_chunk_size(chunk);
     int n = memory_chunk_slot(len);
+    int sub = memory_chunk_sub(len, n);
 //    printf("%s(%p) : removing chunk %#zx [%d]\n", __FUNCTION__, chunk, len, n);
-    DLIST_REMOVE_FROM(&free_chunk[n], chunk, free);
-    mem_free -= len - HEADER_SIZE;
+    memory_tree_remove(&free_chunk[n][sub], chunk);
+    if (free_chunk[n][sub] == NULL) {
+	free_sub_bitmap[n] &= ~(1u << sub);
+	if (free_sub_bitmap[n] == 0) free_bitmap &= ~(1u << n);
+    }
+    mem_free -= len;
+    --mem_stats.free_chunks[n];
+    mem_stats.free_bytes[n] -= len;
 }
 
+// mark chunk as free, write its footer and add it to its free slot
 void push_free(Chunk *chunk) {
     size_t len = memory_chunk_size(chunk);
     int n = memory_chunk_slot(len);
+    int sub = memory_chunk_sub(len, n);
 //    printf("%s(%p) : adding chunk %#zx [%d]\n", __FUNCTION__, chunk, len, n);
-    DLIST_PUSH(&free_chunk[n], chunk, free);
-    mem_free += len - HEADER_SIZE;
+    chunk->size &= ~CHUNK_USED;
+    Chunk *next = memory_chunk_next(chunk);
+    ((size_t*)next)[-1] = chunk->size & ~CHUNK_FLAGS;
+    next->size |= CHUNK_PREV_FREE;
+    memory_tree_insert(&free_chunk[n][sub], chunk);
+    free_sub_bitmap[n] |= 1u << sub;
+    free_bitmap |= 1u << n;
+    mem_free += len;
+    ++mem_stats.free_chunks[n];
+    mem_stats.free_bytes[n] += len;
 }
 
-void free(void *mem) {
-    if (mem == NULL) return;
+// zeroed: the memory is known to be all zero, see memory_hand_out()
+void memory_init(void *mem, size_t size, int zeroed) {
+    first = (Chunk*)(((intptr_t)mem + ALIGN - 1) & (~(ALIGN - 1)));
+    last = (Chunk*)((((intptr_t)mem + size) & (~(ALIGN - 1))) - HEADER_SIZE);
+    // mark last as used so it never gets merged
+    last->size = CHUNK_USED;
+    first->size = (intptr_t)last - (intptr_t)first;
+    // start over with empty free slots
+    memset(free_chunk, 0, sizeof(free_chunk));
+    memset(free_sub_bitmap, 0, sizeof(free_sub_bitmap));
+    free_bitmap = 0;
+    memset(&mem_stats, 0, sizeof(mem_stats));
+    mem_free = 0;
+    mem_used = 0;
+    mem_meta = 2 * HEADER_SIZE;
+    mem_top = zeroed ? first->data + LINKS_SIZE : (char*)last;
+
+    size_t len = memory_chunk_size(first);
+    printf("%s(%p, %#zx) : adding chunk %#zx [%d]\n", __FUNCTION__, mem, size, len, memory_chunk_slot(len));
+    push_free(first);
+
+    int cls = 0;
+    for(int i = 0; i <= SLAB_MAX / SLAB_GRANULE; ++i) {
+	while(slab_class_size[cls] < (size_t)i * SLAB_GRANULE) ++cls;
+	slab_class[i] = cls;
+    }
+    for(cls = 0; cls < NUM_SLAB_CLASSES; ++cls) {
+	slab_cache[cls].partial = NULL;
+	slab_cache[cls].size = slab_class_size[cls];
+	slab_cache[cls].stride =
+	    (SLAB_HEADER + slab_class_size[cls] + ALIGN - 1) & (~(ALIGN - 1));
+    }
+}
+
+/* Shrink chunk to size, returning the tail to the free slots if it is
+ * large enough to form a chunk of its own. The tail is merged with the
+ * following chunk if that is free. Returns 1 if the chunk was split.
+ */
+int memory_chunk_split(Chunk *chunk, size_t size) {
+    size_t len = HEADER_SIZE + size;
+    size_t rest = (chunk->size & ~CHUNK_FLAGS) - len;
+    if (rest < HEADER_SIZE + MIN_SIZE) return 0;
+    Chunk *chunk2 = (Chunk*)((intptr_t)chunk + len);
+    chunk->size = len | (chunk->size & CHUNK_FLAGS);
+    chunk2->size = rest;
+    mem_meta += HEADER_SIZE;
+    Chunk *next = memory_chunk_next(chunk2);
+    if (!(next->size & CHUNK_USED)) {
+	// merge in next
+	remove_free(next);
+	chunk2->size += next->size;
+	mem_meta -= HEADER_SIZE;
+    }
+//    printf("  adding chunk @ %p %#zx\n", chunk2, memory_chunk_size(chunk2));
+    push_free(chunk2);
+    return 1;
+}
+
+/* Find the smallest free chunk of at least size bytes, the lowest one
+ * among equals, or NULL. size must be aligned and at least MIN_SIZE.
+ */
+Chunk *memory_chunk_find(size_t size) {
+    int n = memory_chunk_slot(size);
+    if (n >= NUM_SIZES) return NULL;
+    int sub = memory_chunk_sub(size, n);
+    // smallest chunk in the size's own sub slot that is large enough
+    Chunk *chunk = memory_tree_fit(free_chunk[n][sub], size);
+    if (chunk != NULL) return chunk;
+    // otherwise the smallest chunk of the next non-empty sub slot
+    uint32_t subs = free_sub_bitmap[n] & (~0u << (sub + 1));
+    if (subs == 0) {
+	uint32_t avail = (n + 1 < NUM_SIZES) ? free_bitmap & (~0u << (n + 1)) : 0;
+	if (avail == 0) return NULL;
+	n = __builtin_ctz(avail);
+	subs = free_sub_bitmap[n];
+    }
+    // all of its chunks fit
+    chunk = free_chunk[n][__builtin_ctz(subs)];
+    while (chunk->child[0] != NULL) chunk = chunk->child[0];
+    return chunk;
+}
+
+/* Allocate a chunk of at least size bytes, cleared if clear is set.
+ * Fresh memory only needs the links and footer cleared.
+ */
+void *memory_chunk_get(size_t size, int clear) {
+    // rounding up must not wrap around
+    if (size > SIZE_MAX - ALIGN - HEADER_SIZE) return NULL;
+    size = (size + ALIGN - 1) & (~(ALIGN - 1));
+    if (size < MIN_SIZE) size = MIN_SIZE;
+    Chunk *chunk = memory_chunk_find(size);
+    if (chunk == NULL) return NULL;
+//    printf("@ %p [%#zx]\n", chunk, memory_chunk_size(chunk));
+    remove_free(chunk);
+    chunk->size |= CHUNK_USED;
+    int split = memory_chunk_split(chunk, size);
+    memory_chunk_next(chunk)->size &= ~CHUNK_PREV_FREE;
+    mem_used += memory_chunk_size(chunk);
+    if (clear) {
+	size_t dirty = size;
+	if (chunk->data + size > mem_top) {
+	    dirty = LINKS_SIZE;
+	    if (mem_top > chunk->data + dirty) dirty = mem_top - chunk->data;
+	    // without a split the old footer is still there
+	    if (!split) ((size_t*)memory_chunk_next(chunk))[-1] = 0;
+	}
+	memset(chunk->data, 0, dirty);
+    }
+    memory_hand_out(chunk);
+    return chunk->data;
+}
+
+void *memory_chunk_alloc(size_t size) {
+    return memory_chunk_get(size, 0);
+}
+
+/* Resize an allocated chunk without moving it, growing into the following
+ * chunk if that is free. Returns 0 if there is not enough room.
+ */
+int memory_chunk_resize(void *mem, size_t size) {
     Chunk *chunk = (Chunk*)((intptr_t)mem - HEADER_SIZE);
-    Chunk *next = CONTAINER(Chunk, all, chunk->all.next);
-    Chunk *prev = CONTAINER(Chunk, all, chunk->all.prev);
-    printf("%s(%p): @%p %#zx [%d]\n", __FUNCTION__, mem, chunk, memory_chunk_size(chunk), memory_chunk_slot(memory_chunk_size(chunk)));
+    Chunk *next = memory_chunk_next(chunk);
+    size_t old = memory_chunk_size(chunk);
+    if (size > SIZE_MAX - ALIGN - HEADER_SIZE) return 0;
+    size = (size + ALIGN - 1) & (~(ALIGN - 1));
+    if (size < MIN_SIZE) size = MIN_SIZE;
+    if (size > old) {
+	if (next->size & CHUNK_USED) return 0;
+	if (old + HEADER_SIZE + memory_chunk_size(next) < size) return 0;
+	// absorb next
+	remove_free(next);
+	chunk->size += next->size;
+	memory_chunk_next(chunk)->size &= ~CHUNK_PREV_FREE;
+	mem_meta -= HEADER_SIZE;
+    }
+    memory_chunk_split(chunk, size);
+    memory_hand_out(chunk);
+    mem_used += memory_chunk_size(chunk) - old;
+    return 1;
+}
+
+void memory_chunk_free(void *mem) {
+    Chunk *chunk = (Chunk*)((intptr_t)mem - HEADER_SIZE);
+    Chunk *next = memory_chunk_next(chunk);
     mem_used -= memory_chunk_size(chunk);
-    if (next->used == 0) {
+    if (!(next->size & CHUNK_USED)) {
 	// merge in next
 	remove_free(next);
-	dlist_remove(&next->all);
+	chunk->size += next->size;
 	mem_meta -= HEADER_SIZE;
-	mem_free += HEADER_SIZE;
     }
-    if (prev->used == 0) {
+    if (chunk->size & CHUNK_PREV_FREE) {
 	// merge to prev
+	Chunk *prev = memory_chunk_prev(chunk);
 	remove_free(prev);
-	dlist_remove(&chunk->all);
-	push_free(prev);
+	prev->size += chunk->size & ~CHUNK_FLAGS;
+	chunk = prev;
 	mem_meta -= HEADER_SIZE;
-	mem_free += HEADER_SIZE;
+    }
+    push_free(chunk);
+}
+
+/* Allocate a chunk whose data is aligned to alignment (a power of 2).
+ * The chunk is carved from a larger one, the padding in front and behind
+ * goes back to the free slots.
+ */
+void *memory_chunk_memalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGN) return memory_chunk_alloc(size);
+    if (size > SIZE_MAX - ALIGN - alignment - HEADER_SIZE - MIN_SIZE) return NULL;
+    size = (size + ALIGN - 1) & (~(ALIGN - 1));
+    if (size < MIN_SIZE) size = MIN_SIZE;
+    char *mem = memory_chunk_alloc(size + alignment + HEADER_SIZE + MIN_SIZE);
+    if (mem == NULL) return NULL;
+    char *data = (char*)(((intptr_t)mem + alignment - 1) & (~(alignment - 1)));
+    if (data != mem) {
+	// the padding in front must be large enough to become a free chunk
+	while(data - mem < HEADER_SIZE + MIN_SIZE) data += alignment;
+	Chunk *chunk = (Chunk*)(mem - HEADER_SIZE);
+	Chunk *aligned = (Chunk*)(data - HEADER_SIZE);
+	size_t len = data - mem;
+	aligned->size = ((chunk->size & ~CHUNK_FLAGS) - len) | CHUNK_USED;
+	chunk->size = len | (chunk->size & CHUNK_FLAGS);
+	mem_used -= HEADER_SIZE;
+	mem_meta += HEADER_SIZE;
+	memory_chunk_free(mem);
+    }
+    // give back the tail
+    memory_chunk_resize(data, size);
+    return data;
+}
+
+Slab *memory_slab_new(int cls) {
+    Slab *slab = (Slab*)memory_chunk_alloc(SLAB_SIZE);
+    if (slab == NULL) return NULL;
+    DLIST_INIT(slab, partial);
+    slab->free = NULL;
+    slab->fresh = (char*)slab + ((sizeof(Slab) + ALIGN - 1) & (~(ALIGN - 1)));
+    slab->end = (char*)slab + SLAB_SIZE;
+    slab->used = 0;
+    slab->cls = cls;
+    return slab;
+}
+
+int memory_slab_full(const Slab *slab, const SlabCache *cache) {
+    return slab->free == NULL && slab->fresh + cache->stride > slab->end;
+}
+
+void *memory_slab_alloc(size_t size) {
+    int cls = slab_class[(size + SLAB_GRANULE - 1) / SLAB_GRANULE];
+    SlabCache *cache = &slab_cache[cls];
+    Slab *slab = cache->partial;
+    if (slab == NULL) {
+	slab = memory_slab_new(cls);
+	if (slab == NULL) return NULL;
+	DLIST_PUSH(&cache->partial, slab, partial);
+    }
+    void *mem;
+    if (slab->free != NULL) {
+	mem = slab->free;
+	slab->free = *(void**)mem;
+    } else {
+	Slab **obj = (Slab**)slab->fresh;
+	*obj = slab;
+	mem = obj + 1;
+	slab->fresh += cache->stride;
+    }
+    ++slab->used;
+    ++mem_stats.slab_allocs[cls];
+    if (memory_slab_full(slab, cache)) {
+	// full slabs leave the cache until one of their objects is freed
+	(void)DLIST_POP(&cache->partial, partial);
+    }
+    return mem;
+}
+
+void memory_slab_free(void *mem) {
+    Slab *slab = ((Slab**)mem)[-1];
+    SlabCache *cache = &slab_cache[slab->cls];
+    if (memory_slab_full(slab, cache)) {
+	DLIST_PUSH(&cache->partial, slab, partial);
+    }
+    *(void**)mem = slab->free;
+    slab->free = mem;
+    ++mem_stats.slab_frees[slab->cls];
+    // keep the last slab of a cache around so it doesn't thrash
+    if (--slab->used == 0 && slab->partial.next != &slab->partial) {
+	DLIST_REMOVE_FROM(&cache->partial, slab, partial);
+	memory_chunk_free(slab);
+    }
+}
+
+int memory_is_chunk(const void *mem) {
+    return ((const size_t*)mem)[-1] & 1;
+}
+
+size_t memory_usable_size(void *mem) {
+    if (memory_is_chunk(mem)) {
+	return memory_chunk_size((Chunk*)((intptr_t)mem - HEADER_SIZE));
     } else {
-	// make chunk as free
-	chunk->used = 0;
-	DLIST_INIT(chunk, free);
-	push_free(chunk);
+	Slab *slab = ((Slab**)mem)[-1];
+	return slab_cache[slab->cls].size;
     }
 }
 
+// count an allocation or free of the chunk at mem in its slot
+void memory_chunk_count(size_t *count, const void *mem) {
+    const Chunk *chunk = (const Chunk*)((intptr_t)mem - HEADER_SIZE);
+    ++count[memory_chunk_slot(memory_chunk_size(chunk))];
+}
+
+// size of the largest free chunk
+size_t memory_largest_free(void) {
+    if (free_bitmap == 0) return 0;
+    int n = 31 - __builtin_clz(free_bitmap);
+    int sub = 31 - __builtin_clz(free_sub_bitmap[n]);
+    // the largest chunk is the last in its tree
+    Chunk *chunk = free_chunk[n][sub];
+    while (chunk->child[1] != NULL) chunk = chunk->child[1];
+    return memory_chunk_size(chunk);
+}
+
+void *memory_alloc(size_t size) {
+    void *res;
+    if (size <= SLAB_MAX) {
+	res = memory_slab_alloc(size);
+    } else {
+	res = memory_chunk_alloc(size);
+	if (res) memory_chunk_count(mem_stats.chunk_allocs, res);
+    }
+    return res;
+}
+
+void memory_free(void *mem) {
+    if (memory_is_chunk(mem)) {
+	memory_chunk_count(mem_stats.chunk_frees, mem);
+	memory_chunk_free(mem);
+    } else {
+	memory_slab_free(mem);
+    }
+}
+
+void *memory_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return memory_alloc(size);
+    if (memory_is_chunk(ptr)) {
+	// small sizes move to the slab caches
+	if (size > SLAB_MAX) {
+	    int n = memory_chunk_slot(memory_usable_size(ptr));
+	    if (memory_chunk_resize(ptr, size)) {
+		++mem_stats.chunk_frees[n];
+		memory_chunk_count(mem_stats.chunk_allocs, ptr);
+		return ptr;
+	    }
+	}
+    } else {
+	Slab *slab = ((Slab**)ptr)[-1];
+	if (size <= SLAB_MAX
+	    && slab_class[(size + SLAB_GRANULE - 1) / SLAB_GRANULE] == slab->cls) {
+	    return ptr;
+	}
+    }
+    // copy as last resort
+    size_t old = memory_usable_size(ptr);
+    void *res = memory_alloc(size);
+    if (res == NULL) return NULL;
+    memcpy(res, ptr, (old < size) ? old : size);
+    memory_free(ptr);
+    return res;
+}
+
+void *malloc(size_t size) {
+    void *res = memory_alloc(size);
+    TRACE("m %#zx %p", size, res);
+    return res;
+}
+
+void free(void *mem) {
+    if (mem == NULL) return;
+    TRACE("f %p", mem);
+    memory_free(mem);
+}
+
 void *calloc(size_t nmemb, size_t size) {
     // printf("# %s(%zd, %zd)\n", __FUNCTION__, nmemb, size); // delay(100000000);
+    if (size != 0 && nmemb > (size_t)-1 / size) return NULL;
     size = nmemb * size;
-    void *res = malloc(size);
-    memset(res, 0, size);
+    void *res;
+    if (size <= SLAB_MAX) {
+	res = memory_slab_alloc(size);
+	if (res) memset(res, 0, size);
+    } else {
+	res = memory_chunk_get(size, 1);
+	if (res) memory_chunk_count(mem_stats.chunk_allocs, res);
+    }
+    TRACE("m %#zx %p", size, res);
     return res;
 }
 
 void *realloc(void *ptr, size_t size) {
-    printf("# %s(%p, %zd)\n", __FUNCTION__, ptr, size);
-    delay(100000000);
-    Chunk *chunk = (Chunk*)((intptr_t)ptr - HEADER_SIZE);
-    size_t old = memory_chunk_size(chunk);
-    printf("  old = %zd\n", old);
-    if (old >= size) {
-	printf("### WARNING: %s(): no shrinking\n", __FUNCTION__);
-	return ptr;
-    } else {
-	void *res = malloc(size);
-	memcpy(res, ptr, old);
-	free(ptr);
-	return res;
+    void *res = memory_realloc(ptr, size);
+    TRACE("r %p %#zx %p", ptr, size, res);
+    return res;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) return NULL;
+    void *res = memory_chunk_memalign(alignment, size);
+    if (res) memory_chunk_count(mem_stats.chunk_allocs, res);
+    TRACE("a %#zx %#zx %p", alignment, size, res);
+    return res;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) || alignment < sizeof(void*)) {
+	return EINVAL;
     }
+    void *res = memalign(alignment, size);
+    if (res == NULL) return ENOMEM;
+    *memptr = res;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
 }
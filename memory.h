@@ -25,14 +25,40 @@
 #include <stdint.h>
 #include "list.h"
 
+enum {
+    MEMORY_NUM_SLOTS = 32,
+    MEMORY_NUM_SLAB_CLASSES = 10,
+};
+
+/* Allocator statistics
+ * Chunks are counted per slot n, holding sizes [2^n, 2^(n+1)), small
+ * objects per slab size class, see slab_class_size[].
+ */
+typedef struct MemoryStats {
+    size_t free_chunks[MEMORY_NUM_SLOTS]; // free chunks per slot
+    size_t free_bytes[MEMORY_NUM_SLOTS];  // bytes in free chunks per slot
+    size_t chunk_allocs[MEMORY_NUM_SLOTS];
+    size_t chunk_frees[MEMORY_NUM_SLOTS];
+    size_t slab_allocs[MEMORY_NUM_SLAB_CLASSES];
+    size_t slab_frees[MEMORY_NUM_SLAB_CLASSES];
+} MemoryStats;
+
 extern size_t mem_free;
 extern size_t mem_used;
 extern size_t mem_meta;
+extern MemoryStats mem_stats;
+extern const size_t slab_class_size[MEMORY_NUM_SLAB_CLASSES];
+
+size_t memory_largest_free(void);
 
-void memory_init(void *mem, size_t size);
+// zeroed: the memory is known to be all zero, calloc() takes advantage
+void memory_init(void *mem, size_t size, int zeroed);
 void *malloc(size_t size);
 void free(void *mem);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
+void *memalign(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
 
 #endif // #ifndef OCAML_RPI__MEMORY_H
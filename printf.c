@@ -19,27 +19,50 @@
 #include <stdbool.h>
 
 #include "uart.h"
+#include "string.h"
 #include "printf.h"
-
-#define BUF_SIZE 4096
+#include "dtoa.h"
 
 static _Bool isdigit(unsigned char c) {
     return ((unsigned char)(c - '0') < 10);
 }
 
+/* Sinks
+ *
+ * printf() streams straight into the UART ring buffer, vsnprintf() into
+ * a bounded string that counts what did not fit. Neither needs a buffer
+ * for the whole output, so there is no length limit and stack use is
+ * small enough for IRQ, abort and thread stacks.
+ */
+static void uart_sink_write(Sink *sink, const char *buf, size_t len) {
+    (void)sink;
+    uart_write_all(buf, len);
+}
+
+static Sink uart_sink = { uart_sink_write };
+
+typedef struct StringSink {
+    Sink sink;
+    char *buf;
+    size_t size; // including the trailing '\0'
+    size_t pos;  // characters produced so far
+} StringSink;
+
+static void string_sink_write(Sink *sink, const char *buf, size_t len) {
+    StringSink *str = (StringSink *)sink;
+    if (str->pos + 1 < str->size) {
+	size_t room = str->size - 1 - str->pos;
+	memcpy(str->buf + str->pos, buf, len < room ? len : room);
+    }
+    str->pos += len;
+}
+
 ssize_t printf(const char *format, ...) {
     va_list args;
-    char buf[BUF_SIZE];
     ssize_t len;
     va_start(args, format);
-    len = vsnprintf(buf, BUF_SIZE, format, args);
+    len = vsprintf_sink(&uart_sink, format, args);
     va_end(args);
-    if (len != -1 && len <= BUF_SIZE) {
-	puts(buf);
-    } else {
-	// FIXME: too long
-	panic("printf: too long\n");
-    }
     return len;
 }
 
@@ -80,51 +103,130 @@ int atoi(const char** ptr) {
     return i;
 }
 
-#define buf_add(c) {		     \
-	if (buf < end) { *buf = c; } \
-	++buf;			     \
+/* Formatter output
+ *
+ * Characters are staged in a small buffer and handed to the sink when
+ * it fills up, so sinks are called per chunk and not per character.
+ */
+typedef struct Out {
+    Sink *sink;
+    size_t len; // characters produced so far
+    size_t pos; // characters staged in buf
+    char buf[64];
+} Out;
+
+static void out_flush(Out *out) {
+    if (out->pos > 0) out->sink->write(out->sink, out->buf, out->pos);
+    out->pos = 0;
+}
+
+static inline void out_add(Out *out, char c) {
+    if (out->pos == sizeof(out->buf)) out_flush(out);
+    out->buf[out->pos++] = c;
+    ++out->len;
+}
+
+#define buf_add(c) out_add(out, c)
+
+/* Integer conversion
+ *
+ * The ARM1176 has no divide instruction, every / and % is a libgcc call
+ * and for uint64_t a slow one. Decimal digits are produced two at a time
+ * from a table, dividing by 100 with a multiply by the reciprocal, which
+ * is exact for all 32 bit values. Larger numbers are first split into
+ * chunks of 9 digits, one 64 bit division per chunk instead of one per
+ * digit. Hex only needs shifts.
+ */
+static const char DIGITS2[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// write the digits of v backwards ending at p, returns the first digit
+static char *sprint_dec32(char *p, uint32_t v) {
+    while(v >= 100) {
+	uint32_t q = ((uint64_t)v * 0x51EB851F) >> 37; // v / 100
+	uint32_t r = v - q * 100;
+	p -= 2;
+	p[0] = DIGITS2[2 * r];
+	p[1] = DIGITS2[2 * r + 1];
+	v = q;
+    }
+    if (v >= 10) {
+	p -= 2;
+	p[0] = DIGITS2[2 * v];
+	p[1] = DIGITS2[2 * v + 1];
+    } else {
+	*--p = '0' + v;
+    }
+    return p;
+}
+
+static char *sprint_dec(char *p, uint64_t num) {
+    while(num > UINT32_MAX) {
+	uint64_t q = num / 1000000000;
+	uint32_t r = num - q * 1000000000;
+	char *start = sprint_dec32(p, r);
+	p -= 9;
+	while(start > p) *--start = '0';
+	num = q;
     }
+    return sprint_dec32(p, num);
+}
+
+static char *sprint_hex(char *p, uint64_t num, const char *digits) {
+    uint32_t lo = num, hi = num >> 32;
+    if (hi != 0) {
+	for(int i = 0; i < 8; ++i) {
+	    *--p = digits[lo & 15];
+	    lo >>= 4;
+	}
+	lo = hi;
+    }
+    do {
+	*--p = digits[lo & 15];
+	lo >>= 4;
+    } while(lo != 0);
+    return p;
+}
 
 /* print_int - Convert integer to string
- * @buf:       buffer
- * @end:       end of buffer
+ * @out:       formatter output
  * @num:       number to convert
  * @base:      must be 10 or 16
  * @size:      number of bytes to fill
  * @precision: number of digits for floats
  * @flags:     output flags
- *
- * Returns pointer to end of string as it would be for full conversion but
- * only actualy writes up to excluding 'end'.
  */
-char* sprint_int(char* buf, char* end, uint64_t num, int base, int width, int precision, Flags flags) {
-    const char LOWER[] = "0123456789abcdef";
-    const char UPPER[] = "0123456789ABCDEF";
+void sprint_int(Out *out, uint64_t num, int base, int width, int precision, Flags flags) {
+    static const char LOWER[] = "0123456789abcdef";
+    static const char UPPER[] = "0123456789ABCDEF";
     const char *digits = (flags.upper) ? UPPER : LOWER;
     char tmp[20];
 
     // Sanity check base
-    if (base != 10 && base != 16) return NULL;
+    if (base != 10 && base != 16) return;
 
     // Check for sign
     _Bool negative = false;
     if (flags.sign) {
-	int64_t t = num;
-	if (t < 0) {
-	    num = -t;
+	if ((int64_t)num < 0) {
+	    num = -num;
 	    negative = true;
 	}
     }
 
-    // convert number in reverse order
-    int len = 0;
-    if (num == 0) { // special case
-	tmp[len++] = '0';
-    }
-    while(num > 0) {
-	tmp[len++] = digits[num % base];
-	num /= base;
-    }
+    // convert number from the end of tmp
+    char *end = tmp + sizeof(tmp);
+    char *p = (base == 10) ? sprint_dec(end, num) : sprint_hex(end, num, digits);
+    int len = end - p;
     // Correct presision if number too large
     if (precision < len) precision = len;
 
@@ -136,6 +238,11 @@ char* sprint_int(char* buf, char* end, uint64_t num, int base, int width, int pr
 	width -= 2;
     }
     
+    // Pad with ' ' if not left aligned, before the sign
+    if (!flags.left && !flags.zeropad) {
+	while(precision < width--) buf_add(' ');
+    }
+
     // Put sign if any
     if (negative) {
 	buf_add('-');
@@ -149,9 +256,9 @@ char* sprint_int(char* buf, char* end, uint64_t num, int base, int width, int pr
 	buf_add('x');
     }
 
-    // Pad with ' ' if not left aligned
-    if (!flags.left) {
-	while(precision < width--) buf_add(flags.zeropad ? '0' : ' ');
+    // Pad with '0' if not left aligned, after the sign
+    if (!flags.left && flags.zeropad) {
+	while(precision < width--) buf_add('0');
     }
 
     // Pad with ' ' or '0' to precision
@@ -161,30 +268,138 @@ char* sprint_int(char* buf, char* end, uint64_t num, int base, int width, int pr
     }
 
     // Put number
-    while(len > 0) {
-	buf_add(tmp[--len]);
+    while(p < end) {
+	buf_add(*p++);
 	--width;
     }
 
     // fill remaining space (flags.left was set)
     while(width-- > 0) buf_add(' ');
+}
 
-    return buf;
+/* sprint_float - Convert double to string
+ * @out:       formatter output
+ * @v:         number to convert
+ * @type:      'e', 'f' or 'g'
+ * @width:     number of bytes to fill
+ * @precision: digits after the point, significant digits for 'g'
+ * @flags:     output flags
+ *
+ * Digits come correctly rounded from a DtoaStream one at a time, so
+ * %.300f of 1e300 needs no buffer for them. Past the 767 significant
+ * digits a double can have, dtoa only pads with zeros.
+ */
+void sprint_float(Out *out, double v, char type, int width, int precision, Flags flags) {
+    union { double d; uint64_t u; } x = { v };
+    DtoaStream digits;
+    int n = 0, decpt = 1;
+    const char *special = NULL;
+
+    // Sign
+    char sign = 0;
+    if (x.u >> 63) {
+	sign = '-';
+    } else if (flags.plus) {
+	sign = '+';
+    } else if (flags.space) {
+	sign = ' ';
+    }
+    x.u &= ~(1ull << 63);
+
+    // style 'e' or 'f' with frac digits after the point
+    int frac = precision;
+    if ((x.u >> 52) == 0x7FF) {
+	if ((x.u << 12) != 0) {
+	    special = flags.upper ? "NAN" : "nan";
+	} else {
+	    special = flags.upper ? "INF" : "inf";
+	}
+    } else if (type == 'f') {
+	if (x.u != 0) n = dtoa_stream_init(&digits, x.d, precision, 1, &decpt);
+    } else {
+	if (type == 'g' && precision == 0) precision = 1;
+	int ndigits = (type == 'g') ? precision : precision + 1;
+	if (x.u != 0) n = dtoa_stream_init(&digits, x.d, ndigits, 0, &decpt);
+	if (type == 'g') {
+	    // %f if the exponent X is in [-4, P), without trailing zeros
+	    int exp = (n == 0) ? 0 : decpt - 1;
+	    if (exp >= -4 && exp < precision) {
+		type = 'f';
+		frac = precision - 1 - exp;
+		if (!flags.alternate) frac = (n > decpt) ? n - decpt : 0;
+	    } else {
+		type = 'e';
+		frac = precision - 1;
+		if (!flags.alternate) frac = (n > 1) ? n - 1 : 0;
+	    }
+	}
+    }
+    _Bool point = frac > 0 || flags.alternate;
+    int exp = (n == 0) ? 0 : decpt - 1;
+
+    // Length without padding
+    int len = (sign != 0);
+    if (special != NULL) {
+	len += 3;
+    } else if (type == 'f') {
+	len += ((decpt > 0) ? decpt : 1) + point + frac;
+    } else {
+	len += 1 + point + frac + 2 + ((exp <= -100 || exp >= 100) ? 3 : 2);
+    }
+
+    // Pad with ' ' if not left aligned, before the sign
+    if (!flags.left && (!flags.zeropad || special != NULL)) {
+	while(len < width--) buf_add(' ');
+    }
+    if (sign != 0) buf_add(sign);
+    // Pad with '0' if not left aligned, after the sign
+    if (!flags.left && flags.zeropad && special == NULL) {
+	while(len < width--) buf_add('0');
+    }
+
+    if (special != NULL) {
+	while(*special != 0) buf_add(*special++);
+    } else if (type == 'f') {
+	// digit i is the i-th of the stream, zero outside of the n digits
+	if (decpt <= 0) buf_add('0');
+	for(int i = 0; i < decpt; ++i) buf_add((i < n) ? dtoa_stream_next(&digits) : '0');
+	if (point) buf_add('.');
+	for(int i = decpt; i < decpt + frac; ++i) {
+	    buf_add((i >= 0 && i < n) ? dtoa_stream_next(&digits) : '0');
+	}
+    } else {
+	buf_add((n > 0) ? dtoa_stream_next(&digits) : '0');
+	if (point) buf_add('.');
+	for(int i = 1; i <= frac; ++i) buf_add((i < n) ? dtoa_stream_next(&digits) : '0');
+	buf_add(flags.upper ? 'E' : 'e');
+	buf_add((exp < 0) ? '-' : '+');
+	if (exp < 0) exp = -exp;
+	if (exp >= 100) {
+	    buf_add('0' + exp / 100);
+	    exp %= 100;
+	}
+	buf_add(DIGITS2[2 * exp]);
+	buf_add(DIGITS2[2 * exp + 1]);
+    }
+
+    // fill remaining space (flags.left was set)
+    while(len < width--) buf_add(' ');
 }
 
-/* vsnprintf - Format a string and place it in a buffer
- * @buf:    Buffer for result
- * @size:   Size of buffer including trailing '\0'
+/* vsprintf_sink - Format a string into a sink
+ * @sink:   Sink for the result
  * @format: Format string for output
  * @args:   Arguments for format string
  *
- * Returns the number of characters which would be generated for the given
- * input, excluding the trailing '\0', as per ISO C99. If the result is
- * greater than or equal to @size, the rsulting string is truncated.
+ * Returns the number of characters generated, no trailing '\0' is
+ * written.
  */
-ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
-    char* start = buf;
-    char* end = buf + size;
+ssize_t vsprintf_sink(Sink *sink, const char* format, va_list args) {
+    Out outbuf;
+    Out *out = &outbuf;
+    out->sink = sink;
+    out->len = 0;
+    out->pos = 0;
 
     while(*format != 0) {
 	// Copy normal chars 1:1
@@ -197,7 +412,8 @@ ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
 	/* Flags:
 	 * '+': Always include a '+' or '-' sign for numeric types
 	 * '-': Left align output
-	 * '#': Alternate form, '0x' prefix for p and x
+	 * '#': Alternate form, '0x' prefix for p and x, always a '.' for
+	 *      e, f and g and no zeros stripped for g
 	 * ' ': Include ' ' for postive numbers
 	 * '0': Pad with '0'
 	 */
@@ -274,6 +490,9 @@ ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
 	 * 'd', 'i': signed decimal
 	 * 'u'     : unsigned decimal
 	 * 'x', 'X': unsigned hexadecimal (UPPER case)
+	 * 'e', 'E': double as d.ddde+dd (UPPER case)
+	 * 'f', 'F': double as ddd.ddd (UPPER case)
+	 * 'g', 'G': double as e or f, whichever is shorter (UPPER case)
 	 * 'p'     : signed hexadecimal of a pointer
 	 * 'c'     : character
 	 * 's'     : string
@@ -292,13 +511,14 @@ ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
 	    }
 	    flags.sign = true;
 	    if (precision == -1) precision = 0;
-	    buf = sprint_int(buf, end, num, base, width, precision, flags);
+	    sprint_int(out, num, base, width, precision, flags);
 	    break;
 	case 'p':
 	    flags.alternate = true;
 	    if (precision == -1) precision = 2 * sizeof(void*);
-	case 'X': flags.upper = true;
-	case 'x': base = 16; flags.space = false; flags.zeropad = true;
+	    // fall through
+	case 'X': flags.upper = true; // fall through
+	case 'x': base = 16; flags.space = false; flags.zeropad = true; // fall through
 	case 'u':
 	    switch(length) {
 	    case 1: num = (uint8_t) va_arg(args, int); break;
@@ -307,7 +527,18 @@ ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
 	    case 8: num = (uint64_t)va_arg(args, uint64_t); break;
 	    }
 	    if (precision == -1) precision = 0;
-	    buf = sprint_int(buf, end, num, base, width, precision, flags);
+	    sprint_int(out, num, base, width, precision, flags);
+	    break;
+	case 'E':
+	case 'F':
+	case 'G':
+	    flags.upper = true;
+	    // fall through
+	case 'e':
+	case 'f':
+	case 'g':
+	    if (precision == -1) precision = 6;
+	    sprint_float(out, va_arg(args, double), format[-1] | 0x20, width, precision, flags);
 	    break;
 	case 'c':
 	    buf_add(va_arg(args, int));
@@ -334,7 +565,24 @@ ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
 	    buf_add(*format++);
 	}
     }
-    buf_add(0);
-    if (size > 0) end[-1] = 0; // always terminate buffer if there is any
-    return (buf - start) - 1;
+    out_flush(out);
+    return out->len;
+}
+
+/* vsnprintf - Format a string and place it in a buffer
+ * @buf:    Buffer for result
+ * @size:   Size of buffer including trailing '\0'
+ * @format: Format string for output
+ * @args:   Arguments for format string
+ *
+ * Returns the number of characters which would be generated for the given
+ * input, excluding the trailing '\0', as per ISO C99. If the result is
+ * greater than or equal to @size, the rsulting string is truncated.
+ */
+ssize_t vsnprintf(char* buf, size_t size, const char* format, va_list args) {
+    StringSink str = { { string_sink_write }, buf, size, 0 };
+    ssize_t len = vsprintf_sink(&str.sink, format, args);
+    // always terminate buffer if there is any
+    if (size > 0) buf[str.pos < size ? str.pos : size - 1] = 0;
+    return len;
 }
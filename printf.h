@@ -30,6 +30,19 @@
 
 #define __PRINTFLIKE(__fmt,__varargs) __attribute__((__format__ (__printf__, __fmt, __varargs)))
 
+/* Output sink for the formatter
+ *
+ * write() gets the output in order, in pieces of any size. Embed Sink
+ * as first member to give it state.
+ */
+typedef struct Sink Sink;
+struct Sink {
+    void (*write)(Sink *sink, const char *buf, size_t len);
+};
+
+// format into a sink, returns the number of characters produced
+ssize_t vsprintf_sink(Sink *sink, const char *format, va_list args);
+
 ssize_t printf(const char *format, ...) __PRINTFLIKE(1, 2);
 ssize_t snprintf(char *buf, size_t size, const char *format, ...) __PRINTFLIKE(3, 4);
 ssize_t vsnprintf(char *buf, size_t size, const char *format, va_list args);
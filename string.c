@@ -19,84 +19,339 @@
  * string and memory functions
  */
 
+#include <stdint.h>
 #include "string.h"
-#include "printf.h"
+#include "trace.h"
 
-void delay(uint32_t);
+/* Block copies and fills
+ *
+ * Both ends are handled bytewise until the destination is word aligned.
+ * The middle is copied a word at a time, in bursts of 8 words using
+ * LDM/STM with a PLD prefetch ahead on ARM and plain C elsewhere, so
+ * the same code can be tested on the host. If source and destination
+ * are not aligned the same way the source is read in aligned words and
+ * shifted into place (little endian). That reads a partial word beyond
+ * the source, but never across an aligned word, so it cannot fault.
+ * memset() works the same way with the byte replicated into a word.
+ */
+
+// keep gcc from turning the loops below back into calls to memcpy()
+#pragma GCC optimize ("no-tree-loop-distribute-patterns")
+
+typedef uintptr_t __attribute__((may_alias)) Word;
+enum { WORD = sizeof(Word), BURST = 8 };
+
+// copy words forward, both aligned
+static void copy_fwd_aligned(Word *d, const Word *s, size_t words) {
+#ifdef __arm__
+    while(words >= BURST) {
+	asm volatile("pld   [%[s], #64]\n\t"
+		     "ldmia %[s]!, {r3-r10}\n\t"
+		     "stmia %[d]!, {r3-r10}"
+		     : [d]"+r"(d), [s]"+r"(s)
+		     :
+		     : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "memory");
+	words -= BURST;
+    }
+#else
+    while(words >= BURST) {
+	Word a = s[0], b = s[1], c = s[2], e = s[3];
+	Word f = s[4], g = s[5], h = s[6], i = s[7];
+	d[0] = a; d[1] = b; d[2] = c; d[3] = e;
+	d[4] = f; d[5] = g; d[6] = h; d[7] = i;
+	d += BURST;
+	s += BURST;
+	words -= BURST;
+    }
+#endif
+    while(words-- > 0) *d++ = *s++;
+}
+
+// copy words backward ending at d and s, both aligned
+static void copy_bwd_aligned(Word *d, const Word *s, size_t words) {
+#ifdef __arm__
+    while(words >= BURST) {
+	asm volatile("pld   [%[s], #-96]\n\t"
+		     "ldmdb %[s]!, {r3-r10}\n\t"
+		     "stmdb %[d]!, {r3-r10}"
+		     : [d]"+r"(d), [s]"+r"(s)
+		     :
+		     : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "memory");
+	words -= BURST;
+    }
+#else
+    while(words >= BURST) {
+	d -= BURST;
+	s -= BURST;
+	Word a = s[7], b = s[6], c = s[5], e = s[4];
+	Word f = s[3], g = s[2], h = s[1], i = s[0];
+	d[7] = a; d[6] = b; d[5] = c; d[4] = e;
+	d[3] = f; d[2] = g; d[1] = h; d[0] = i;
+	words -= BURST;
+    }
+#endif
+    while(words-- > 0) *--d = *--s;
+}
+
+// copy words forward to aligned d from unaligned s
+static void copy_fwd_shifted(Word *d, const char *s, size_t words) {
+    size_t off = (uintptr_t)s & (WORD - 1);
+    const Word *ws = (const Word *)(s - off);
+    unsigned shr = off * 8, shl = (WORD - off) * 8;
+    Word lo = *ws++;
+    while(words-- > 0) {
+	Word hi = *ws++;
+	*d++ = (lo >> shr) | (hi << shl);
+	lo = hi;
+    }
+}
+
+// copy words backward ending at aligned d and unaligned s
+static void copy_bwd_shifted(Word *d, const char *s, size_t words) {
+    size_t off = (uintptr_t)s & (WORD - 1);
+    const Word *ws = (const Word *)(s - off);
+    unsigned shr = off * 8, shl = (WORD - off) * 8;
+    Word hi = *ws;
+    while(words-- > 0) {
+	Word lo = *--ws;
+	*--d = (lo >> shr) | (hi << shl);
+	hi = lo;
+    }
+}
+
+static void copy_fwd(char *d, const char *s, size_t n) {
+    if (n >= 2 * WORD) {
+	while((uintptr_t)d & (WORD - 1)) {
+	    *d++ = *s++;
+	    --n;
+	}
+	size_t words = n / WORD;
+	if (((uintptr_t)s & (WORD - 1)) == 0) {
+	    copy_fwd_aligned((Word *)d, (const Word *)s, words);
+	} else {
+	    copy_fwd_shifted((Word *)d, s, words);
+	}
+	d += words * WORD;
+	s += words * WORD;
+	n -= words * WORD;
+    }
+    while(n-- > 0) *d++ = *s++;
+}
+
+// copy n bytes ending at d and s
+static void copy_bwd(char *d, const char *s, size_t n) {
+    if (n >= 2 * WORD) {
+	while((uintptr_t)d & (WORD - 1)) {
+	    *--d = *--s;
+	    --n;
+	}
+	size_t words = n / WORD;
+	if (((uintptr_t)s & (WORD - 1)) == 0) {
+	    copy_bwd_aligned((Word *)d, (const Word *)s, words);
+	} else {
+	    copy_bwd_shifted((Word *)d, s, words);
+	}
+	d -= words * WORD;
+	s -= words * WORD;
+	n -= words * WORD;
+    }
+    while(n-- > 0) *--d = *--s;
+}
 
 void *memmove(void *dest, const void *src, size_t n) {
     // puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
     char *d = (char *)dest;
     const char *s = (const char *)src;
     if (d < s || (size_t)(d - s) >= n) {
-	while(n-- > 0) *d++ = *s++;
+	copy_fwd(d, s, n);
     } else {
-	d += n;
-	s += n;
-	while(n-- > 0) *--d = *--s;
+	copy_bwd(d + n, s + n, n);
     }
     return dest;
 }
 
 void *memcpy(void *dest, const void *src, size_t n) {
-    printf("# %s(dest=%p, src=%p, size=%zd)\n", __FUNCTION__, dest, src, n);
-    delay(100000000);
-    char *d = (char *)dest;
-    const char *s = (const char *)src;
-    while(n-- > 0) *d++ = *s++;
+    TRACE_DEBUG("%s(dest=%p, src=%p, size=%zd)", __FUNCTION__, dest, src, n);
+    copy_fwd((char *)dest, (const char *)src, n);
     return dest;
 }
 
+// fill aligned words with w
+static void fill_words(Word *d, Word w, size_t words) {
+#ifdef __arm__
+    if (words >= BURST) {
+	size_t bursts = words / BURST;
+	asm volatile("mov   r3, %[w]\n\t"
+		     "mov   r4, %[w]\n\t"
+		     "mov   r5, %[w]\n\t"
+		     "mov   r6, %[w]\n\t"
+		     "mov   r7, %[w]\n\t"
+		     "mov   r8, %[w]\n\t"
+		     "mov   r9, %[w]\n\t"
+		     "mov   r10, %[w]\n"
+		     "1:\n\t"
+		     "stmia %[d]!, {r3-r10}\n\t"
+		     "subs  %[n], %[n], #1\n\t"
+		     "bne   1b"
+		     : [d]"+r"(d), [n]"+r"(bursts)
+		     : [w]"r"(w)
+		     : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "cc", "memory");
+	words &= BURST - 1;
+    }
+#else
+    while(words >= BURST) {
+	d[0] = w; d[1] = w; d[2] = w; d[3] = w;
+	d[4] = w; d[5] = w; d[6] = w; d[7] = w;
+	d += BURST;
+	words -= BURST;
+    }
+#endif
+    while(words-- > 0) *d++ = w;
+}
+
 void *memset(void *s, int c, size_t n) {
-    printf("# %s(s = %p, c = %#2x, n = %zd)\n", __FUNCTION__, s, c, n);
-    // delay(100000000);
+    TRACE_DEBUG("%s(s = %p, c = %#2x, n = %zd)", __FUNCTION__, s, c, n);
     char *p = (char *)s;
+    if (n >= 2 * WORD) {
+	while((uintptr_t)p & (WORD - 1)) {
+	    *p++ = c;
+	    --n;
+	}
+	// replicate the byte into every byte of a word
+	Word w = (unsigned char)c * (~(Word)0 / 0xff);
+	size_t words = n / WORD;
+	fill_words((Word *)p, w, words);
+	p += words * WORD;
+	n -= words * WORD;
+    }
     while(n-- > 0) *p++ = c;
     return s;
 }
 
+/* Compares and string scans
+ *
+ * These work a word at a time too. A word w contains a zero byte iff
+ * (w - 0x01010101) & ~w & 0x80808080 is non-zero, so a string can be
+ * scanned for its terminator without looking at each byte. Loads are
+ * aligned so reading past the terminator never crosses into the next
+ * page. Once a word differs or holds the terminator the rest is done
+ * bytewise. Bytes compare as unsigned char.
+ */
+
+#define ONES (~(Word)0 / 0xff)
+#define HIGHS (ONES << 7)
+
+static inline Word has_zero(Word w) {
+    return (w - ONES) & ~w & HIGHS;
+}
+
+// count leading equal words of aligned p and any q
+static size_t equal_words(const Word *p, const char *q, size_t words) {
+    size_t res = 0;
+    size_t off = (uintptr_t)q & (WORD - 1);
+    if (off == 0) {
+	const Word *wq = (const Word *)q;
+	while(res < words && p[res] == wq[res]) ++res;
+    } else {
+	const Word *wq = (const Word *)(q - off);
+	unsigned shr = off * 8, shl = (WORD - off) * 8;
+	Word lo = *wq++;
+	while(res < words) {
+	    Word hi = *wq++;
+	    if (p[res] != ((lo >> shr) | (hi << shl))) break;
+	    lo = hi;
+	    ++res;
+	}
+    }
+    return res;
+}
+
 int memcmp(const void *s1, const void *s2, size_t n) {
-    printf("# %s(s1=%p, s2=%p, size=%zd)\n", __FUNCTION__, s1, s2, n);
-    delay(100000000);
-    const char *p = (const char *)s1;
-    const char *q = (const char *)s2;
-    int t = 0;
-    while(t == 0 && n-- > 0) {
-	t = *p++ - *q++;
+    TRACE_DEBUG("%s(s1=%p, s2=%p, size=%zd)", __FUNCTION__, s1, s2, n);
+    const unsigned char *p = (const unsigned char *)s1;
+    const unsigned char *q = (const unsigned char *)s2;
+    if (n >= 2 * WORD) {
+	while((uintptr_t)p & (WORD - 1)) {
+	    if (*p != *q) return *p - *q;
+	    ++p;
+	    ++q;
+	    --n;
+	}
+	size_t words = equal_words((const Word *)p, (const char *)q, n / WORD);
+	p += words * WORD;
+	q += words * WORD;
+	n -= words * WORD;
     }
-    return t;
+    while(n-- > 0) {
+	if (*p != *q) return *p - *q;
+	++p;
+	++q;
+    }
+    return 0;
 }
 
-char *strcat(char *dest, const char *src) {
-    printf("# %s(dest=%p, src=%p)\n", __FUNCTION__, dest, src);
-    delay(100000000);
-    char *p = dest;
-    while(*p++);
-    while(*src) { *p++ = *src++; }
-    return dest;
+size_t strlen(const char *s) {
+    TRACE_DEBUG("%s(s=%p)", __FUNCTION__, s);
+    const char *p = s;
+    while((uintptr_t)p & (WORD - 1)) {
+	if (*p == 0) return p - s;
+	++p;
+    }
+    const Word *w = (const Word *)p;
+    while(!has_zero(*w)) ++w;
+    p = (const char *)w;
+    while(*p) ++p;
+    return p - s;
 }
 
 int strcmp(const char *s1, const char *s2) {
-    printf("# %s(s1=%p, s2=%p)\n", __FUNCTION__, s1, s2);
-    delay(100000000);
-    int t = 0;
-    while(t != 0 && *s1) {
-	t = (*s1++) - (*s2++);
+    TRACE_DEBUG("%s(s1=%p, s2=%p)", __FUNCTION__, s1, s2);
+    const unsigned char *p = (const unsigned char *)s1;
+    const unsigned char *q = (const unsigned char *)s2;
+    while((uintptr_t)p & (WORD - 1)) {
+	if (*p != *q || *p == 0) return *p - *q;
+	++p;
+	++q;
+    }
+    size_t off = (uintptr_t)q & (WORD - 1);
+    if (off == 0) {
+	const Word *wp = (const Word *)p, *wq = (const Word *)q;
+	while(*wp == *wq && !has_zero(*wp)) {
+	    ++wp;
+	    ++wq;
+	}
+	p = (const unsigned char *)wp;
+	q = (const unsigned char *)wq;
+    } else {
+	// s2 is read shifted, only load the next word of s2 when the
+	// bytes left in this one hold no terminator
+	const Word *wp = (const Word *)p, *wq = (const Word *)(q - off);
+	unsigned shr = off * 8, shl = (WORD - off) * 8;
+	Word lo = *wq++;
+	while(!has_zero((lo >> shr) | (~(Word)0 << shl))) {
+	    Word hi = *wq++;
+	    if (*wp != ((lo >> shr) | (hi << shl)) || has_zero(*wp)) break;
+	    lo = hi;
+	    ++wp;
+	}
+	q += (const unsigned char *)wp - p;
+	p = (const unsigned char *)wp;
     }
-    return t;
+    while(*p == *q && *p != 0) {
+	++p;
+	++q;
+    }
+    return *p - *q;
 }
 
 char *strcpy(char *dest, const char *src) {
-    printf("# %s(dest=%p, src=%p)\n", __FUNCTION__, dest, src);
-    // delay(100000000);
-    char *p = dest;
-    while(*src) *p++ = *src++;
+    TRACE_DEBUG("%s(dest=%p, src=%p)", __FUNCTION__, dest, src);
+    copy_fwd(dest, src, strlen(src) + 1);
     return dest;
 }
 
-size_t strlen(const char *s) {
-    // puts("# "); puts(__FUNCTION__); puts("()\n"); // delay(100000000);
-    size_t res = 0;
-    while(*s++) ++res;
-    return res;
+char *strcat(char *dest, const char *src) {
+    TRACE_DEBUG("%s(dest=%p, src=%p)", __FUNCTION__, dest, src);
+    strcpy(dest + strlen(dest), src);
+    return dest;
 }
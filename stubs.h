@@ -0,0 +1,27 @@
+/* stubs.h - Helpers shared by the ocaml stubs
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCAML_RPI__STUBS_H
+#define OCAML_RPI__STUBS_H
+
+#include <stddef.h>
+#include <caml/mlvalues.h>
+
+// an ocaml int array of the counters in data (Memory_stubs.c)
+value stubs_int_array(const size_t *data, int len);
+
+#endif // #ifndef OCAML_RPI__STUBS_H
@@ -0,0 +1,169 @@
+/* bitmap.c - Free slot lookup benchmark
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Compare the lookup from before the bitmaps, a division loop for the
+ * slot and a walk up the list heads of the slots, with memory_chunk_find()
+ * on the heap states produced by the random workload of test/memory.c.
+ * memory_chunk_find() takes two ctz to the sub slot and then descends its
+ * treap, so it is O(log n) in the chunks of that sub slot. Also check
+ * that it finds the address ordered best fit a walk over the whole heap
+ * finds.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define OCAML_RPI__STRING_H
+#define PRINTF_H
+#include "../memory.c"
+#include "util.h"
+
+#define MEM_SIZE (1024*1024*1024)
+char MEM[MEM_SIZE] = { 0 };
+
+#define MAX_BLOCK (1024*1024*2)
+#define NUM_SLOTS 1024
+#define NUM_OPS 100000
+#define NUM_LOOKUPS 256
+#define CHECK_EVERY 1000
+void *slot[NUM_SLOTS] = { NULL };
+size_t lookup_size[NUM_LOOKUPS];
+
+/* The old free lists: one per slot, the chunks of a slot taken from
+ * the head. old_head[n] stands in for the list of slot n and is
+ * refreshed from the trees before each round of lookups.
+ */
+Chunk *old_head[NUM_SIZES];
+
+void old_refresh(void) {
+    for(int n = 0; n < NUM_SIZES; ++n) {
+	old_head[n] = NULL;
+	for(int sub = 0; sub < NUM_SUB; ++sub) {
+	    if (free_chunk[n][sub] != NULL) old_head[n] = free_chunk[n][sub];
+	}
+    }
+}
+
+int old_slot(size_t size) {
+    int n = -1;
+    while(size > 0) {
+	++n;
+	size /= 2;
+    }
+    return n;
+}
+
+// the lookup of memory_chunk_alloc() before the bitmap
+Chunk *old_find(size_t size) {
+    int n = old_slot(size - 1) + 1;
+    if (n >= NUM_SIZES) return NULL;
+    while(!old_head[n]) {
+	++n;
+	if (n >= NUM_SIZES) return NULL;
+    }
+    return old_head[n];
+}
+
+// loop iterations of old_find()
+int old_steps(size_t size) {
+    int n = old_slot(size - 1) + 1;
+    int steps = n;
+    while(n < NUM_SIZES && !old_head[n]) {
+	++n;
+	++steps;
+    }
+    return steps;
+}
+
+intptr_t linear_find(size_t size) {
+    return (intptr_t)old_find(size);
+}
+
+intptr_t bitmap_find(size_t size) {
+    return (intptr_t)memory_chunk_find(size);
+}
+
+// smallest free chunk of at least size bytes, lowest among equals
+Chunk *best_fit(size_t size) {
+    Chunk *best = NULL;
+    for(Chunk *it = first; it != last; it = memory_chunk_next(it)) {
+	if ((it->size & CHUNK_USED) || memory_chunk_size(it) < size) continue;
+	if (best == NULL || memory_chunk_before(it, best)) best = it;
+    }
+    return best;
+}
+
+typedef struct Stats {
+    const char *name;
+    double total;
+} Stats;
+
+volatile intptr_t sink;
+
+void measure(Stats *stats, intptr_t (*find)(size_t)) {
+    double start = now();
+    for(int i = 0; i < NUM_LOOKUPS; ++i) {
+	sink = find(lookup_size[i]);
+    }
+    stats->total += now() - start;
+}
+
+int main() {
+    // malloc() traces through stdio, which must not malloc() itself
+    static char stdout_buf[BUFSIZ];
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+    memory_init(MEM, MEM_SIZE, 1);
+    for(int i = 0; i < NUM_LOOKUPS; ++i) {
+	// spread sizes over all slots
+	size_t bits = 4 + random() % 24;
+	size_t size = ((size_t)1 << bits) + random() % ((size_t)1 << bits);
+	lookup_size[i] = (size + ALIGN - 1) & (~(ALIGN - 1));
+    }
+    Stats old = { "old", 0 };
+    Stats new = { "new", 0 };
+    int max_steps = 0;
+    for(int i = 0; i < NUM_OPS; ++i) {
+	size_t size = MIN_SIZE + random() % MAX_BLOCK;
+	int n = random() % NUM_SLOTS;
+	if (slot[n]) {
+	    memory_chunk_free(slot[n]);
+	}
+	old_refresh();
+	for(int j = 0; j < NUM_LOOKUPS; ++j) {
+	    int steps = old_steps(lookup_size[j]);
+	    if (steps > max_steps) max_steps = steps;
+	    if (i % CHECK_EVERY == 0) {
+		assert(memory_chunk_find(lookup_size[j]) == best_fit(lookup_size[j]));
+	    }
+	}
+	measure(&old, linear_find);
+	measure(&new, bitmap_find);
+	slot[n] = memory_chunk_alloc(size);
+    }
+    Stats *stats[] = { &old, &new };
+    for(int i = 0; i < 2; ++i) {
+	printf("%-6s: %5.1f ns/lookup\n", stats[i]->name,
+	       stats[i]->total * 1e9 / NUM_OPS / NUM_LOOKUPS);
+    }
+    printf("old lookup: up to %d loop iterations\n", max_steps);
+    return 0;
+}
@@ -0,0 +1,353 @@
+/* dtoa.c - double conversion test
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Check the shortest digits round trip through glibc strtod() and that
+ * one digit less never does, fixed precision digits against glibc %e
+ * and %f, and the kernel strtod() against glibc on random, halfway and
+ * edge inputs. Then benchmark all three against glibc. The kernel
+ * strtod() is renamed to rpi_strtod so glibc stays usable.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#define strtod rpi_strtod
+#include "../dtoa.c"
+#include "util.h"
+#undef strtod
+
+uint64_t random64(void) {
+    return ((uint64_t)random() << 42) ^ ((uint64_t)random() << 21) ^ random();
+}
+
+// a positive finite double with random bits
+double random_double(void) {
+    Double x;
+    do {
+	x.u = random64() & ~(1ull << 63);
+    } while(x.u >= INF_BITS || x.u == 0);
+    return x.d;
+}
+
+uint64_t bits(double d) {
+    Double x = { d };
+    return x.u;
+}
+
+double from_bits(uint64_t u) {
+    Double x;
+    x.u = u;
+    return x.d;
+}
+
+// digits and decimal point of glibc "%.*e", without trailing zeros
+int glibc_digits(double v, int ndigits, char *digits, int *decpt) {
+    static char buf[2048];
+    snprintf(buf, sizeof(buf), "%.*e", ndigits - 1, v);
+    char *e = strchr(buf, 'e');
+    int n = 0;
+    for(char *p = buf; p < e; ++p) {
+	if (*p != '.') digits[n++] = *p;
+    }
+    *decpt = atoi(e + 1) + 1;
+    while(n > 0 && digits[n - 1] == '0') --n;
+    return n;
+}
+
+// value of 0.digits * 10^decpt through glibc
+double glibc_read(const char *digits, int n, int decpt) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "0.%.*se%d", n, digits, decpt);
+    return strtod(buf, NULL);
+}
+
+void check_shortest(double v) {
+    char digits[DTOA_DIGITS_MAX], ref[DTOA_DIGITS_MAX];
+    int decpt, ref_decpt;
+    int n = dtoa_shortest(v, digits, &decpt);
+    assert(n >= 1 && n <= 17 && digits[0] != '0' && digits[n - 1] != '0');
+    // round trips
+    assert(bits(glibc_read(digits, n, decpt)) == bits(v));
+    // the correctly rounded n digits are the answer when they round trip
+    int m = glibc_digits(v, n, ref, &ref_decpt);
+    if (bits(glibc_read(ref, m, ref_decpt)) == bits(v)) {
+	assert(m == n && decpt == ref_decpt && memcmp(digits, ref, n) == 0);
+    }
+    // and no number with fewer digits does: check both neighbours
+    if (n > 1) {
+	char lo[20], hi[20];
+	int lo_decpt, hi_decpt, hi_n = n - 1;
+	m = glibc_digits(v, 40, ref, &lo_decpt);
+	assert(m >= n);
+	memcpy(lo, ref, n - 1);
+	memcpy(hi, ref, n - 1);
+	hi_decpt = lo_decpt;
+	round_up(hi, &hi_n, &hi_decpt);
+	assert(bits(glibc_read(lo, n - 1, lo_decpt)) != bits(v));
+	assert(bits(glibc_read(hi, hi_n, hi_decpt)) != bits(v));
+    }
+}
+
+void test_shortest(void) {
+    static const double cases[] = {
+	1.0, 0.1, 0.3, 1e23, 9007199254740991.0, 9007199254740992.0,
+	5e-324, 1e-323, 2.2250738585072014e-308, 2.2250738585072009e-308,
+	1.7976931348623157e308, 123456789012345680.0, 1.5, 2.5, 0.5,
+	4.35, 1e21, 1e22, 1e-7, 299792458.0,
+    };
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) check_shortest(cases[i]);
+    // all powers of 2 have the asymmetric interval
+    for(int e = 0; e < 52; ++e) check_shortest(from_bits(1ull << e));
+    for(uint64_t e = 1; e < 0x7FF; ++e) check_shortest(from_bits(e << MANTISSA_BITS));
+    for(int i = 0; i < 1000000; ++i) check_shortest(random_double());
+    // small integers and short decimals
+    for(int i = 1; i < 100000; ++i) {
+	check_shortest(i);
+	check_shortest(i / 1000.0);
+    }
+    printf("shortest: OK\n");
+}
+
+void check_fixed(double v, int count, bool decimals) {
+    char digits[DTOA_DIGITS_MAX], ref[2048];
+    static char buf[2048];
+    int decpt, ref_decpt, m;
+    int n = decimals ? dtoa_decimals(v, count, digits, &decpt)
+		     : dtoa_precision(v, count, digits, &decpt);
+    if (decimals) {
+	// glibc %f: integer and fraction part
+	snprintf(buf, sizeof(buf), "%.*f", count, v);
+	m = 0;
+	ref_decpt = 0;
+	char *p = buf;
+	while(*p == '0') ++p;
+	bool point = false;
+	for(; *p != 0; ++p) {
+	    if (*p == '.') {
+		point = true;
+		continue;
+	    }
+	    if (m == 0 && *p == '0') {
+		--ref_decpt; // leading zero after the point
+		continue;
+	    }
+	    ref[m++] = *p;
+	    if (!point) ++ref_decpt;
+	}
+	while(m > 0 && ref[m - 1] == '0') --m;
+	if (m == 0) ref_decpt = 1;
+    } else {
+	m = glibc_digits(v, count, ref, &ref_decpt);
+    }
+    if (n != m || decpt != ref_decpt || memcmp(digits, ref, n) != 0) {
+	printf("%.17g %s %d: got %.*s e%d, glibc %.*s e%d\n", v,
+	       decimals ? "decimals" : "digits", count, n, digits, decpt, m, ref, ref_decpt);
+	fflush(stdout);
+	assert(false);
+    }
+    // the stream hands out the same digits, then zeros
+    DtoaStream st;
+    int st_decpt;
+    assert(dtoa_stream_init(&st, v, count, decimals, &st_decpt) == n);
+    assert(st_decpt == decpt);
+    for(int i = 0; i < n + 3; ++i) assert(dtoa_stream_next(&st) == ((i < n) ? digits[i] : '0'));
+}
+
+void test_fixed(void) {
+    for(int i = 0; i < 200000; ++i) {
+	double v = random_double();
+	check_fixed(v, 1 + random() % 20, false);
+	// %f of numbers near 1
+	double w = from_bits((bits(v) & MANTISSA_MASK) | (1023 + random() % 80 - 40) << MANTISSA_BITS);
+	check_fixed(w, random() % 25, true);
+    }
+    // exact ties and carries
+    static const double cases[] = {
+	0.5, 1.5, 2.5, 0.125, 0.375, 9.5, 99.5, 999.5, 0.05, 0.25,
+	9.9999999999999999e22, 1e23, 5e-324, 1.7976931348623157e308,
+	0.3, 2.675, 1.005,
+    };
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+	for(int c = 0; c < 30; ++c) {
+	    check_fixed(cases[i], c + 1, false);
+	    check_fixed(cases[i], c, true);
+	}
+    }
+    // the full expansion of subnormals and huge numbers
+    for(int i = 0; i < 1000; ++i) {
+	double v = random_double();
+	check_fixed(v, 800, false);
+	check_fixed(from_bits(random64() & MANTISSA_MASK), 800, false);
+	check_fixed(v, random() % 1100, true);
+    }
+    printf("fixed: OK\n");
+}
+
+void check_strtod(const char *s) {
+    char *end, *ref_end;
+    errno = 0;
+    double v = rpi_strtod(s, &end);
+    int err = errno;
+    errno = 0;
+    double ref = strtod(s, &ref_end);
+    int ref_err = errno;
+    // glibc puts the n-char-sequence of nan(...) into the payload
+    if (v != v && ref != ref) ref = from_bits((bits(ref) & (1ull << 63)) | (bits(v) & ~(1ull << 63)));
+    if (bits(v) != bits(ref) || end != ref_end || err != ref_err) {
+	printf("strtod(\"%s\"): got %a end %zd errno %d, glibc %a end %zd errno %d\n",
+	       s, v, end - s, err, ref, ref_end - s, ref_err);
+	fflush(stdout);
+	assert(false);
+    }
+}
+
+void test_strtod(void) {
+    static const char *cases[] = {
+	"", " ", "+", "-", ".", "e5", "0", "-0", "+0.0e10", "  \t\n12abc",
+	"1e", "1e+", "1e-x", "1.e3", ".5", "5.", "00000.00000001",
+	"inf", "-INF", "Infinity", "infinit", "nan", "-NaN", "nan(123)",
+	"nan(", "nan()x", "0x", "0x.", "0x1p", "0x1.8p1", "0X1P-1074",
+	"0x1p-1075", "0x1.0000000000001p-1075", "0x3p-1076", "0x1p1024",
+	"0x1.fffffffffffff8p1023", "0x1.fffffffffffff7ffp1023",
+	"0x123456789abcdef0123p0", "-0x0.0000001p-1000",
+	"1e308", "1.7976931348623157e308", "1.7976931348623158e308",
+	"1.7976931348623159e308", "1e309", "1e400", "-1e99999999999",
+	"2.2250738585072011e-308", "2.2250738585072012e-308",
+	"4.9406564584124654e-324", "2.4703282292062327e-324",
+	"2.4703282292062328e-324", "2.4703282292062327208828439643411e-324",
+	"1e-324", "1e-400", "1e-99999999999", "9007199254740993",
+	"9007199254740992.5", "9007199254740993.0000000001",
+	"123456789012345678901234567890", "1e23", "8.589973e9",
+	"0.1", "0.30000000000000004", "3.14159265358979323846",
+	"123e30", "9007199254740991e22", "9007199254740991e23",
+    };
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) check_strtod(cases[i]);
+
+    char buf[4096];
+    for(int i = 0; i < 300000; ++i) {
+	double v = random_double();
+	// round trips
+	snprintf(buf, sizeof(buf), "%.17g", v);
+	check_strtod(buf);
+	snprintf(buf, sizeof(buf), "%.*e", (int)(random() % 25), v);
+	check_strtod(buf);
+	// random digits and exponents
+	int n = 1 + random() % 30;
+	for(int j = 0; j < n; ++j) buf[j] = '0' + random() % 10;
+	snprintf(buf + n, 32, "e%d", (int)(random() % 700) - 350);
+	check_strtod(buf);
+	// exact halfway points, and a hair above and below
+	long double mid = ((long double)v + (long double)from_bits(bits(v) + 1)) / 2;
+	if (bits(v) < 0x7FEFFFFFFFFFFFFFull) {
+	    snprintf(buf, sizeof(buf) - 16, "%.800Le", mid);
+	    char *e = strchr(buf, 'e');
+	    char *last = e - 1;
+	    while(*last == '0') --last;
+	    char exp[16];
+	    strcpy(exp, e);
+	    strcpy(last + 1, exp);
+	    check_strtod(buf);
+	    strcpy(last + 1, "0000001");
+	    strcat(buf, exp);
+	    check_strtod(buf);
+	    --*last;
+	    check_strtod(buf);
+	}
+    }
+    // halfway points of subnormals need the most digits
+    for(int i = 0; i < 2000; ++i) {
+	double v = from_bits(random64() & MANTISSA_MASK);
+	long double mid = ((long double)v + (long double)from_bits(bits(v) + 1)) / 2;
+	snprintf(buf, sizeof(buf), "%.1000Le", mid);
+	check_strtod(buf);
+    }
+    // digits beyond the 800 that are kept
+    memset(buf, '0', 2000);
+    buf[0] = '1';
+    buf[2000] = 0;
+    check_strtod(buf);
+    buf[1999] = '1';
+    check_strtod(buf);
+    printf("strtod: OK\n");
+}
+
+enum { N = 4096, REPS = 200 };
+double nums[N];
+char strs[N][32];
+
+void bench(void) {
+    char buf[64];
+    int decpt;
+    volatile int sink = 0;
+    for(int i = 0; i < N; ++i) {
+	nums[i] = random_double();
+	snprintf(strs[i], sizeof(strs[i]), "%.17g", nums[i]);
+    }
+    printf("ns per conversion: kernel, glibc\n");
+
+    double start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) sink += dtoa_shortest(nums[i], buf, &decpt);
+    }
+    double t1 = now() - start;
+    start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) sink += snprintf(buf, sizeof(buf), "%.17e", nums[i]);
+    }
+    double t2 = now() - start;
+    printf("  shortest / %%.17e : %7.1f %7.1f\n", t1 * 1e9 / (N * REPS), t2 * 1e9 / (N * REPS));
+
+    start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) sink += dtoa_precision(nums[i], 12, buf, &decpt);
+    }
+    t1 = now() - start;
+    start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) sink += snprintf(buf, sizeof(buf), "%.11e", nums[i]);
+    }
+    t2 = now() - start;
+    printf("  12 digits / %%.11e: %7.1f %7.1f\n", t1 * 1e9 / (N * REPS), t2 * 1e9 / (N * REPS));
+
+    double sum = 0;
+    start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) sum += rpi_strtod(strs[i], NULL);
+    }
+    t1 = now() - start;
+    start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) sum += strtod(strs[i], NULL);
+    }
+    t2 = now() - start;
+    printf("  strtod %%.17g     : %7.1f %7.1f\n", t1 * 1e9 / (N * REPS), t2 * 1e9 / (N * REPS));
+    (void)sum;
+}
+
+int main() {
+    test_shortest();
+    test_fixed();
+    test_strtod();
+    bench();
+    return 0;
+}
@@ -55,5 +55,27 @@ int main() {
     DLIST_ITERATOR_BEGIN(h, dlist, loop) {
 	printf("@ %p {id = %d, next = %p, prev = %p}\n", loop, loop->id, loop->dlist.next, loop->dlist.prev);
     } DLIST_ITERATOR_END(loop);
+
+    // a FIFO: append at the back, pop from the front
+    Test *fifo = NULL;
+    Test t[4];
+    for (int i = 0; i < 4; ++i) {
+	test_init(&t[i]);
+	DLIST_APPEND(&fifo, &t[i], dlist);
+    }
+    for (int i = 0; i < 4; ++i) {
+	Test *first = DLIST_POP(&fifo, dlist);
+	if (first != &t[i] || first->dlist.next != &first->dlist) {
+	    printf("DLIST_APPEND: popped id %d, expected %d\n", first->id, t[i].id);
+	    return 1;
+	}
+	// re-append the first one, it comes back after the rest
+	if (i == 0) DLIST_APPEND(&fifo, first, dlist);
+    }
+    Test *last = DLIST_POP(&fifo, dlist);
+    if (last != &t[0] || fifo != NULL) {
+	printf("DLIST_APPEND: re-appended element not last\n");
+	return 1;
+    }
     return 0;
 }
@@ -16,7 +16,16 @@
  *
  * --
  *
- * Test memory manager.
+ * Test memory manager by replaying an allocation trace.
+ *
+ * Usage: test/memory [trace]
+ *
+ * The trace is the console output of a kernel built with MEMORY_TRACE,
+ * all "#T" lines are replayed. Without a trace a random workload is
+ * generated. Reports latency per operation, peak footprint and
+ * fragmentation and checks the heap invariants along the way. Then
+ * checks calloc(), on a zero and on a dirty heap, and the aligned
+ * allocations.
  */
 
 #include <stdio.h>
@@ -24,88 +33,578 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #define OCAML_RPI__STRING_H
+#define PRINTF_H
 #include "../memory.c"
+#include "util.h"
 
 #define MEM_SIZE (1024*1024*1024)
 char MEM[MEM_SIZE] = { 0 };
 
-#define MAX_BLOCK (1024*1024*2)
+// random workload
+#define MAX_BLOCK (1024*1024)
 #define NUM_SLOTS 1024
-void *slot[NUM_SLOTS] = { NULL };
-size_t slot_size[NUM_SLOTS] = { 0 };
+#define NUM_RANDOM_OPS 1000000
+
+#define MAX_OPS (1 << 23)
+#define MAX_BLOCKS (1 << 23)
+#define CHECK_EVERY 1000
+
+typedef struct Op {
+    char type;    // 'm'alloc, 'f'ree, 'r'ealloc, 'a'ligned
+    uint32_t id;  // block, the old block for realloc
+    uint32_t id2; // new block for realloc
+    size_t size;
+    size_t align;
+} Op;
+
+typedef struct Block {
+    void *mem;
+    size_t size;
+} Block;
+
+Op op[MAX_OPS];
+int num_ops = 0;
+Block block[MAX_BLOCKS];
+uint32_t num_blocks = 1; // 0 is the NULL block
 
-void delay(uint32_t count) {
-    (void)count;
+// fresh memory in a free chunk must still be zero, check both ends
+void check_fresh(Chunk *chunk) {
+    const unsigned char *p = (const unsigned char *)chunk->data + LINKS_SIZE;
+    if ((char*)p < mem_top) p = (const unsigned char *)mem_top;
+    const unsigned char *end = (const unsigned char *)memory_chunk_next(chunk) - sizeof(size_t);
+    size_t len = p < end ? end - p : 0;
+    for(size_t i = 0; i < len; ++i) {
+	if (i == 256 && len > 512) i = len - 256;
+	assert(p[i] == 0);
+    }
+}
+
+/* Walk a free tree in order: sorted by size then address, every chunk
+ * ranking below its parent, all free and in the right slot.
+ */
+void check_tree(const Chunk *chunk, int n, int sub, const Chunk **prev,
+		size_t *count, size_t *bytes) {
+    if (chunk == NULL) return;
+    for(int c = 0; c < 2; ++c) {
+	if (chunk->child[c]) assert(memory_chunk_rank(chunk->child[c]) <= memory_chunk_rank(chunk));
+    }
+    check_tree(chunk->child[0], n, sub, prev, count, bytes);
+    assert(*prev == NULL || memory_chunk_before(*prev, chunk));
+    assert(!(chunk->size & CHUNK_USED));
+    assert(memory_chunk_slot(memory_chunk_size(chunk)) == n);
+    assert(memory_chunk_sub(memory_chunk_size(chunk), n) == sub);
+    ++*count;
+    *bytes += memory_chunk_size(chunk);
+    *prev = chunk;
+    check_tree(chunk->child[1], n, sub, prev, count, bytes);
 }
 
 void check(void) {
-    Chunk *t = last;
-    DLIST_ITERATOR_BEGIN(first, all, it) {
-	assert(CONTAINER(Chunk, all, it->all.prev) == t);
-	t = it;
-    } DLIST_ITERATOR_END(it);
+    size_t free_bytes = 0, used_bytes = 0, meta_bytes = HEADER_SIZE;
+    size_t largest = 0;
+    int prev_free = 0;
+    for(Chunk *it = first; it != last; it = memory_chunk_next(it)) {
+	assert(it < last);
+	assert(!(it->size & CHUNK_PREV_FREE) == !prev_free);
+	prev_free = !(it->size & CHUNK_USED);
+	if (prev_free) {
+	    // no two free chunks next to each other
+	    assert(memory_chunk_next(it)->size & CHUNK_USED);
+	    size_t footer = ((size_t*)memory_chunk_next(it))[-1];
+	    assert(footer == memory_chunk_size(it) + HEADER_SIZE);
+	    check_fresh(it);
+	    free_bytes += memory_chunk_size(it);
+	    if (memory_chunk_size(it) > largest) largest = memory_chunk_size(it);
+	} else {
+	    // nothing above mem_top was handed out
+	    assert((char*)memory_chunk_next(it) <= mem_top);
+	    used_bytes += memory_chunk_size(it);
+	}
+	meta_bytes += HEADER_SIZE;
+    }
+    assert(!(last->size & CHUNK_PREV_FREE) == !prev_free);
+    assert(free_bytes == mem_free);
+    assert(used_bytes == mem_used);
+    assert(meta_bytes == mem_meta);
+    assert(largest == memory_largest_free());
     for(int i = 0; i < NUM_SIZES; ++i) {
-	if (free_chunk[i]) {
-	    t = CONTAINER(Chunk, free, free_chunk[i]->free.prev);
-	    DLIST_ITERATOR_BEGIN(free_chunk[i], free, it) {
-		assert(CONTAINER(Chunk, free, it->free.prev) == t);
-		t = it;
-	    } DLIST_ITERATOR_END(it);
+	assert(!(free_bitmap & (1u << i)) == !free_sub_bitmap[i]);
+	size_t count = 0, bytes = 0;
+	for(int s = 0; s < NUM_SUB; ++s) {
+	    assert(!(free_sub_bitmap[i] & (1u << s)) == !free_chunk[i][s]);
+	    const Chunk *prev = NULL;
+	    check_tree(free_chunk[i][s], i, s, &prev, &count, &bytes);
 	}
+	assert(mem_stats.free_chunks[i] == count);
+	assert(mem_stats.free_bytes[i] == bytes);
+    }
+}
+
+/* Map addresses in the trace to block ids
+ * Open addressing with linear probing and backward shift deletion.
+ */
+#define MAP_SIZE (1 << 24)
+typedef struct Entry {
+    uint64_t addr;
+    uint32_t id;
+} Entry;
+Entry map[MAP_SIZE];
+
+uint32_t map_hash(uint64_t addr) {
+    return (uint32_t)((addr * 0x9E3779B97F4A7C15ull) >> 40) & (MAP_SIZE - 1);
+}
+
+void map_add(uint64_t addr, uint32_t id) {
+    uint32_t i = map_hash(addr);
+    while(map[i].id != 0 && map[i].addr != addr) i = (i + 1) & (MAP_SIZE - 1);
+    map[i].addr = addr;
+    map[i].id = id;
+}
+
+// remove addr from the map, returns its id or 0 if unknown
+uint32_t map_take(uint64_t addr) {
+    uint32_t i = map_hash(addr);
+    while(map[i].id != 0 && map[i].addr != addr) i = (i + 1) & (MAP_SIZE - 1);
+    uint32_t id = map[i].id;
+    if (id == 0) return 0;
+    uint32_t j = i;
+    while(1) {
+	map[i].id = 0;
+	uint32_t home;
+	do {
+	    j = (j + 1) & (MAP_SIZE - 1);
+	    if (map[j].id == 0) return id;
+	    home = map_hash(map[j].addr);
+	    // move j into the hole at i unless its home lies in (i, j]
+	} while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+	map[i] = map[j];
+	i = j;
     }
 }
 
-void fill_block(void *mem, size_t size) {
-//    printf("%s(%p, %#zx)\n", __FUNCTION__, mem, size);
-    void **p = (void **)mem;
-    for(size_t i = 0; i < size / sizeof(void*); ++i) {
-	*p++ = mem;
+uint32_t new_block(void) {
+    assert(num_blocks < MAX_BLOCKS);
+    return num_blocks++;
+}
+
+Op *new_op(char type) {
+    assert(num_ops < MAX_OPS);
+    Op *o = &op[num_ops++];
+    o->type = type;
+    o->id = 0;
+    o->id2 = 0;
+    o->size = 0;
+    o->align = 0;
+    return o;
+}
+
+// parse a hex number or "(nil)"
+uint64_t parse(char **p) {
+    while(**p == ' ') ++*p;
+    if (strncmp(*p, "(nil)", 5) == 0) {
+	*p += 5;
+	return 0;
     }
+    return strtoull(*p, p, 16);
 }
 
-void check_block(void *mem, size_t size) {
-//    printf("%s(%p, %#zx)\n", __FUNCTION__, mem, size);
-    void **p = (void **)mem;
-    for(size_t i = 0; i < size / sizeof(void*); ++i) {
-	if (p[i] != mem) {
-	    fprintf(stderr, "ERROR: memory contents changed in block %p [%#zx] @ %p\n", mem, size, &p[i]);
-	    assert(0==1);
+void load_trace(FILE *file) {
+    char line[1024];
+    while(fgets(line, sizeof(line), file)) {
+	char *p = strstr(line, "#T ");
+	if (p == NULL) continue;
+	char type = p[3];
+	p += 4;
+	uint64_t a = parse(&p);
+	uint64_t b = parse(&p);
+	uint64_t c = parse(&p);
+	Op *o;
+	switch(type) {
+	case 'm': // m size res
+	    if (b == 0) break;
+	    o = new_op('m');
+	    o->size = a;
+	    o->id = new_block();
+	    map_add(b, o->id);
+	    break;
+	case 'a': // a alignment size res
+	    if (c == 0) break;
+	    o = new_op('a');
+	    o->align = a;
+	    o->size = b;
+	    o->id = new_block();
+	    map_add(c, o->id);
+	    break;
+	case 'f': { // f ptr
+	    uint32_t id = map_take(a);
+	    if (id == 0) break; // allocated before the trace started
+	    o = new_op('f');
+	    o->id = id;
+	    break;
+	}
+	case 'r': { // r ptr size res
+	    if (c == 0) break; // failed, the old block stays
+	    o = new_op('r');
+	    o->id = map_take(a);
+	    o->size = b;
+	    o->id2 = new_block();
+	    map_add(c, o->id2);
+	    break;
+	}
 	}
     }
 }
 
-int main() {
-    printf("sizeof(DLIST) = %zd\n", sizeof(DList));
-    printf("HEADER_SIZE = %d\n", HEADER_SIZE);
-    memory_init(MEM, MEM_SIZE);
-    printf("mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx\n", mem_free, mem_used, mem_meta);
-    for(int i = 0; i < 100000000; ++i) {
+// the workload the old test ran
+void random_trace(void) {
+    uint32_t slot[NUM_SLOTS] = { 0 };
+    for(int i = 0; i < NUM_RANDOM_OPS; ++i) {
 	size_t size = random() % MAX_BLOCK;
 	int n = random() % NUM_SLOTS;
-	check();
+	Op *o;
+	if (slot[n] && random() % 4 == 0) {
+	    o = new_op('r');
+	    o->id = slot[n];
+	    o->size = size;
+	    o->id2 = slot[n] = new_block();
+	    continue;
+	}
 	if (slot[n]) {
-	    check_block(slot[n], slot_size[n]);
-	    free(slot[n]);
-	    printf("%d: mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx\n", i, mem_free, mem_used, mem_meta);
+	    o = new_op('f');
+	    o->id = slot[n];
+	}
+	o = new_op('m');
+	o->size = size;
+	o->id = slot[n] = new_block();
+    }
+}
+
+/* latency histogram per operation type
+ * Exact to the ns up to HIST_EXACT, then in steps of 1us.
+ */
+#define HIST_EXACT 32768
+#define HIST_SIZE 65536
+typedef struct Latency {
+    const char *name;
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint32_t hist[HIST_SIZE];
+} Latency;
+
+Latency latency[4] = { { "malloc", 0, 0, 0, { 0 } }, { "free", 0, 0, 0, { 0 } },
+		       { "realloc", 0, 0, 0, { 0 } }, { "memalign", 0, 0, 0, { 0 } } };
+uint64_t timer_overhead = ~0ull;
+
+void record(Latency *lat, uint64_t start, uint64_t end) {
+    uint64_t t = end - start;
+    t = (t > timer_overhead) ? t - timer_overhead : 0;
+    ++lat->count;
+    lat->total += t;
+    if (t > lat->max) lat->max = t;
+    uint64_t i = (t < HIST_EXACT) ? t : HIST_EXACT + ((t - HIST_EXACT) >> 10);
+    ++lat->hist[(i < HIST_SIZE) ? i : HIST_SIZE - 1];
+}
+
+uint64_t percentile(const Latency *lat, double p) {
+    uint64_t want = (uint64_t)(lat->count * p);
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_SIZE; ++i) {
+	seen += lat->hist[i];
+	if (seen > want) return (i < HIST_EXACT) ? (uint64_t)i : HIST_EXACT + ((uint64_t)(i - HIST_EXACT) << 10);
+    }
+    return lat->max;
+}
+
+double fragmentation(void) {
+    return (mem_free == 0) ? 0.0 : 1.0 - (double)memory_largest_free() / mem_free;
+}
+
+// calloc() must clear both fresh and recycled memory
+void test_calloc(void) {
+    static unsigned char *mem[NUM_SLOTS];
+    static size_t len[NUM_SLOTS];
+    for(int i = 0; i < 100000; ++i) {
+	int n = random() % NUM_SLOTS;
+	if (mem[n]) {
+	    memset(mem[n], 0xa5, len[n]);
+	    free(mem[n]);
 	}
+	len[n] = random() % (1 << (4 + random() % 14));
+	mem[n] = calloc(1, len[n]);
+	assert(mem[n] != NULL);
+	for(size_t j = 0; j < len[n]; ++j) assert(mem[n][j] == 0);
+	if (i % CHECK_EVERY == 0) check();
+    }
+    for(int n = 0; n < NUM_SLOTS; ++n) {
+	free(mem[n]);
+	mem[n] = NULL;
+    }
+    check();
+    assert(calloc((size_t)-1 / 2, 4) == NULL);
+    printf("calloc: OK\n");
+}
+
+/* Free n blocks of the same size, each between two used ones so they
+ * stay apart, in random order. The free slots must not slow down with
+ * the number of free chunks of a size.
+ */
+void test_free_scaling(void) {
+    enum { MAX_N = 50000 };
+    static void *mem[2 * MAX_N];
+    for(int n = 1000; n <= MAX_N; n *= (n == 1000) ? 10 : 5) {
+	for(int i = 0; i < 2 * n; ++i) {
+	    mem[i] = malloc(1000);
+	    assert(mem[i] != NULL);
+	}
+	// shuffle the odd ones
+	for(int i = n - 1; i > 0; --i) {
+	    int j = random() % (i + 1);
+	    void *t = mem[2 * i + 1];
+	    mem[2 * i + 1] = mem[2 * j + 1];
+	    mem[2 * j + 1] = t;
+	}
+	uint64_t start = now_ns();
+	for(int i = 0; i < n; ++i) free(mem[2 * i + 1]);
+	uint64_t t_free = now_ns() - start;
+	start = now_ns();
+	for(int i = 0; i < n; ++i) mem[2 * i + 1] = malloc(1000);
+	uint64_t t_malloc = now_ns() - start;
 	check();
-	slot[n] = malloc(size);
-	if (slot[n]) {
-	    slot_size[n] = size;
-	    fill_block(slot[n], slot_size[n]);
+	for(int i = 0; i < 2 * n; ++i) free(mem[i]);
+	printf("%5d free chunks of a size: free %4.0f ns, malloc %4.0f ns\n",
+	       n, (double)t_free / n, (double)t_malloc / n);
+    }
+    check();
+}
+
+// memalign, posix_memalign and aligned_alloc
+void test_memalign(void) {
+    static void *mem[NUM_SLOTS];
+    static size_t len[NUM_SLOTS];
+    size_t initial_free = mem_free, initial_used = mem_used, initial_meta = mem_meta;
+
+    // invalid alignments
+    void *p = NULL;
+    assert(posix_memalign(&p, 24, 100) == EINVAL);
+    assert(posix_memalign(&p, sizeof(void*) / 2, 100) == EINVAL);
+    assert(memalign(3, 100) == NULL);
+    assert(p == NULL);
+
+    // the padding is not kept with the block
+    p = memalign(4096, 4096);
+    assert(((intptr_t)p & 4095) == 0);
+    assert(memory_usable_size(p) < 4096 + HEADER_SIZE + MIN_SIZE);
+    assert(mem_used - initial_used == memory_usable_size(p));
+    check();
+    free(p);
+    check();
+    assert(mem_free == initial_free);
+
+    for(int i = 0; i < 200000; ++i) {
+	int n = random() % NUM_SLOTS;
+	if (mem[n]) {
+	    check_block(mem[n], len[n], (size_t)mem[n], 1);
+	    free(mem[n]);
+	}
+	size_t alignment = (size_t)1 << (random() % 17);
+	len[n] = random() % (1024 * 64);
+	switch(random() % 3) {
+	case 0:
+	    mem[n] = memalign(alignment, len[n]);
+	    break;
+	case 1:
+	    if (alignment < sizeof(void*)) alignment = sizeof(void*);
+	    assert(posix_memalign(&mem[n], alignment, len[n]) == 0);
+	    break;
+	case 2:
+	    mem[n] = aligned_alloc(alignment, len[n]);
+	    break;
+	}
+	assert(mem[n] != NULL);
+	assert(((intptr_t)mem[n] & (alignment - 1)) == 0);
+	assert(memory_usable_size(mem[n]) >= len[n]);
+	fill_block(mem[n], len[n], (size_t)mem[n]);
+	if (i % CHECK_EVERY == 0) check();
+    }
+    for(int n = 0; n < NUM_SLOTS; ++n) {
+	if (mem[n]) {
+	    check_block(mem[n], len[n], (size_t)mem[n], 1);
+	    free(mem[n]);
 	}
-	printf("%d: mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx, slot[%d] = %p\n", i, mem_free, mem_used, mem_meta, n, slot[n]);
     }
-    for(int i = 0; i < NUM_SLOTS; ++i) {
-	if (slot[i]) {
+    check();
+    // everything merged back
+    assert(mem_used == initial_used);
+    assert(mem_free == initial_free);
+    assert(mem_meta == initial_meta);
+    printf("memalign: OK\n");
+}
+
+// sizes close to SIZE_MAX must fail instead of wrapping to tiny blocks
+void test_huge(void) {
+    volatile size_t huge = (size_t)-3; // keep gcc from warning
+    size_t initial_used = mem_used;
+    assert(malloc(huge) == NULL);
+    assert(memalign(64, huge) == NULL);
+    assert(memalign(64, huge - 64) == NULL);
+    unsigned char *p = malloc(4096);
+    fill_block(p, 4096, (size_t)p);
+    assert(realloc(p, huge) == NULL);
+    assert(memory_usable_size(p) >= 4096);
+    check_block(p, 4096, (size_t)p, 1);
+    free(p);
+    check();
+    assert(mem_used == initial_used);
+    printf("huge: OK\n");
+}
+
+int main(int argc, char *argv[]) {
+    // malloc() traces through stdio, which must not malloc() itself
+    static char stdout_buf[BUFSIZ];
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+    printf("sizeof(DLIST) = %zd\n", sizeof(DList));
+    printf("HEADER_SIZE = %d\n", HEADER_SIZE);
+    // calloc() on a heap holding garbage, before anything lives in it
+    memset(MEM, 0xa5, sizeof(MEM));
+    memory_init(MEM, MEM_SIZE, 0);
+    test_calloc();
+    memset(MEM, 0, sizeof(MEM));
+    memory_init(MEM, MEM_SIZE, 1);
+    printf("mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx\n", mem_free, mem_used, mem_meta);
+
+    if (argc > 1) {
+	FILE *file = fopen(argv[1], "r");
+	if (file == NULL) {
+	    perror(argv[1]);
+	    return 1;
+	}
+	load_trace(file);
+	fclose(file);
+    } else {
+	random_trace();
+    }
+    printf("trace: %s, %d ops, %u blocks\n", (argc > 1) ? argv[1] : "random", num_ops, num_blocks - 1);
+
+    for(int i = 0; i < 1000; ++i) {
+	uint64_t t = now_ns();
+	t = now_ns() - t;
+	if (t < timer_overhead) timer_overhead = t;
+    }
+
+    size_t base_used = mem_used, base_meta = mem_meta;
+    size_t live = 0, peak = 0, peak_live = 0;
+    double peak_frag = 0, sum_frag = 0;
+    int samples = 0, failed = 0;
+    uint64_t start, end;
+    for(int i = 0; i < num_ops; ++i) {
+	Op *o = &op[i];
+	Block *b = &block[o->id];
+	switch(o->type) {
+	case 'm':
+	case 'a':
+	    start = now_ns();
+	    if (o->type == 'm') {
+		b->mem = malloc(o->size);
+	    } else {
+		b->mem = memalign(o->align, o->size);
+	    }
+	    end = now_ns();
+	    record(&latency[(o->type == 'm') ? 0 : 3], start, end);
+	    if (b->mem == NULL) {
+		++failed;
+		break;
+	    }
+	    if (o->type == 'a') assert(((intptr_t)b->mem & (o->align - 1)) == 0);
+	    b->size = o->size;
+	    live += b->size;
+	    fill_block(b->mem, b->size, o->id);
+	    break;
+	case 'f':
+	    if (b->mem == NULL) break;
+	    check_block(b->mem, b->size, o->id, 1);
+	    start = now_ns();
+	    free(b->mem);
+	    end = now_ns();
+	    record(&latency[1], start, end);
+	    live -= b->size;
+	    b->mem = NULL;
+	    break;
+	case 'r': {
+	    Block *b2 = &block[o->id2];
+	    if (b->mem) check_block(b->mem, b->size, o->id, 1);
+	    start = now_ns();
+	    b2->mem = realloc(b->mem, o->size);
+	    end = now_ns();
+	    record(&latency[2], start, end);
+	    if (b2->mem == NULL) {
+		// the old block lives on as the new one
+		++failed;
+		*b2 = *b;
+		b->mem = NULL;
+		fill_block(b2->mem, b2->size, o->id2);
+		break;
+	    }
+	    if (b->mem) {
+		check_block(b2->mem, (o->size < b->size) ? o->size : b->size, o->id, 0);
+		live -= b->size;
+	    }
+	    b->mem = NULL;
+	    b2->size = o->size;
+	    live += b2->size;
+	    fill_block(b2->mem, b2->size, o->id2);
+	    break;
+	}
+	}
+	size_t footprint = mem_used + mem_meta - base_used - base_meta;
+	if (footprint > peak) {
+	    peak = footprint;
+	    peak_live = live;
+	    peak_frag = fragmentation();
+	}
+	if (i % CHECK_EVERY == 0) {
 	    check();
-	    check_block(slot[i], slot_size[i]);
-	    free(slot[i]);
-	    printf("mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx\n", mem_free, mem_used, mem_meta);
+	    sum_frag += fragmentation();
+	    ++samples;
 	}
     }
     check();
+    double end_frag = fragmentation();
+
+    uint64_t total_ns = 0, total_ops = 0;
+    for(int i = 0; i < 4; ++i) {
+	Latency *lat = &latency[i];
+	if (lat->count == 0) continue;
+	total_ns += lat->total;
+	total_ops += lat->count;
+	printf("%-8s: %8llu ops, avg %5.0f ns, p50 %5llu ns, p99 %5llu ns, max %7llu ns\n",
+	       lat->name, (unsigned long long)lat->count,
+	       (double)lat->total / lat->count,
+	       (unsigned long long)percentile(lat, 0.5),
+	       (unsigned long long)percentile(lat, 0.99),
+	       (unsigned long long)lat->max);
+    }
+    printf("total   : %.2f Mops/s inside the allocator, %d failed\n",
+	   total_ns ? total_ops * 1e3 / total_ns : 0.0, failed);
+    printf("peak footprint %#zx for %#zx live bytes (%.1f%% overhead)\n",
+	   peak, peak_live, peak_live ? 100.0 * (peak - peak_live) / peak_live : 0.0);
+    printf("fragmentation: %.3f at peak, %.3f average, %.3f at end\n",
+	   peak_frag, samples ? sum_frag / samples : 0.0, end_frag);
+
+    for(uint32_t id = 1; id < num_blocks; ++id) {
+	if (block[id].mem) {
+	    check_block(block[id].mem, block[id].size, id, 1);
+	    free(block[id].mem);
+	}
+    }
+    check();
+    printf("mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx\n", mem_free, mem_used, mem_meta);
+    test_calloc();
+    test_memalign();
+    test_huge();
+    test_free_scaling();
     return 0;
 }
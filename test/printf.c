@@ -0,0 +1,342 @@
+/* printf.c - formatted output test
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Check the kernel formatter: integer conversion against glibc on edge
+ * values, truncation and return values of vsnprintf() and output far
+ * larger than any buffer streaming through printf() into the UART.
+ * Floats in all styles and flags against glibc. Then benchmark integer
+ * conversion against the old digit loop. The UART is replaced by a
+ * capture buffer and the kernel functions are renamed to rpi_* so glibc
+ * stays usable.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define OCAML_RPI__STRING_H
+#define MOOSE_KERNEL_UART_H
+#define printf rpi_printf
+#define snprintf rpi_snprintf
+#define vsnprintf rpi_vsnprintf
+#define atoi rpi_atoi
+#define isdigit rpi_isdigit
+#define strtod rpi_strtod
+void uart_write_all(const char *buf, size_t count);
+#include "../printf.c"
+#include "../dtoa.c"
+#include "util.h"
+#undef strtod
+#undef printf
+#undef snprintf
+#undef vsnprintf
+
+#define CAPTURE_SIZE (4 * 1024 * 1024)
+char capture[CAPTURE_SIZE];
+size_t captured = 0;
+size_t writes = 0;
+size_t largest_write = 0;
+
+// stands in for the UART ring buffer
+void uart_write_all(const char *buf, size_t count) {
+    assert(captured + count <= CAPTURE_SIZE);
+    memcpy(capture + captured, buf, count);
+    captured += count;
+    ++writes;
+    if (count > largest_write) largest_write = count;
+}
+
+void reset(void) {
+    captured = 0;
+    writes = 0;
+    largest_write = 0;
+}
+
+void test_fixed(void) {
+    char buf[256];
+    const char *expect = "-42|42|ff|FF|abc|z|%|-9223372036854775808|ab";
+    ssize_t len = rpi_snprintf(buf, sizeof(buf), "%d|%u|%x|%X|%s|%c|%%|%lld|%.2s",
+			       -42, 42u, 255, 255, "abc", 'z', (long long)INT64_MIN, "abc");
+    assert(len == (ssize_t)strlen(expect));
+    assert(strcmp(buf, expect) == 0);
+
+    len = rpi_snprintf(buf, sizeof(buf), "[%5d|%-5d|%*d]", 42, 42, 4, 7);
+    assert(strcmp(buf, "[   42|42   |   7]") == 0 && len == 18);
+}
+
+// every size truncates to a terminated prefix and returns the full length
+void test_truncate(void) {
+    char full[256], buf[256];
+    ssize_t len = rpi_snprintf(full, sizeof(full), "%s %d %x %s", "hello", 123456, 0xbeef, "world");
+    assert(len == (ssize_t)strlen(full));
+    for(size_t size = 0; size < (size_t)len + 4; ++size) {
+	memset(buf, 'X', sizeof(buf));
+	assert(rpi_snprintf(buf, size, "%s %d %x %s", "hello", 123456, 0xbeef, "world") == len);
+	if (size > 0) {
+	    size_t n = size - 1 < (size_t)len ? size - 1 : (size_t)len;
+	    assert(memcmp(buf, full, n) == 0);
+	    assert(buf[n] == 0);
+	}
+	assert(buf[size] == 'X');
+    }
+}
+
+// output much larger than the old 4k buffer streams in small pieces
+void test_stream(void) {
+    size_t n = 1024 * 1024;
+    char *big = malloc(n + 1);
+    for(size_t i = 0; i < n; ++i) big[i] = 'a' + i % 26;
+    big[n] = 0;
+
+    reset();
+    ssize_t len = rpi_printf("<%s|%d>", big, -1);
+    assert(len == (ssize_t)n + 5);
+    assert(captured == (size_t)len);
+    assert(capture[0] == '<' && memcmp(capture + 1, big, n) == 0);
+    assert(memcmp(capture + 1 + n, "|-1>", 4) == 0);
+    assert(largest_write <= 64);
+    printf("printf: %zd bytes in %zd writes of up to %zd bytes\n", len, writes, largest_write);
+
+    // and the same through vsnprintf into a large enough buffer
+    char *out = malloc(n + 16);
+    assert(rpi_snprintf(out, n + 16, "<%s|%d>", big, -1) == len);
+    assert(memcmp(out, capture, len) == 0 && out[len] == 0);
+    free(out);
+    free(big);
+}
+
+// integers against glibc, which agrees for these formats
+void check_int(uint64_t num) {
+    char buf[64], ref[64];
+    rpi_snprintf(buf, sizeof(buf), "%llu", (unsigned long long)num);
+    snprintf(ref, sizeof(ref), "%llu", (unsigned long long)num);
+    assert(strcmp(buf, ref) == 0);
+    rpi_snprintf(buf, sizeof(buf), "%lld", (long long)num);
+    snprintf(ref, sizeof(ref), "%lld", (long long)num);
+    assert(strcmp(buf, ref) == 0);
+    rpi_snprintf(buf, sizeof(buf), "%llx|%llX", (unsigned long long)num, (unsigned long long)num);
+    snprintf(ref, sizeof(ref), "%llx|%llX", (unsigned long long)num, (unsigned long long)num);
+    assert(strcmp(buf, ref) == 0);
+    uint32_t lo = num;
+    int32_t slo = lo;
+    rpi_snprintf(buf, sizeof(buf), "%u|%d|%x|%12d|%-12d|%012d", lo, slo, lo, slo, slo, slo);
+    snprintf(ref, sizeof(ref), "%u|%d|%x|%12d|%-12d|%012d", lo, slo, lo, slo, slo, slo);
+    assert(strcmp(buf, ref) == 0);
+}
+
+void test_int(void) {
+    // all small numbers, every digit count and carry
+    for(uint64_t i = 0; i < 1000000; ++i) check_int(i);
+    // around powers of 10 and 2, in both signs
+    uint64_t p10 = 1;
+    for(int i = 0; i < 20; ++i, p10 *= 10) {
+	for(int d = -3; d <= 3; ++d) {
+	    check_int(p10 + d);
+	    check_int(-(p10 + d));
+	}
+    }
+    for(int i = 0; i < 64; ++i) {
+	for(int d = -3; d <= 3; ++d) {
+	    check_int((1ull << i) + d);
+	    check_int(-((1ull << i) + d));
+	}
+    }
+    check_int(UINT64_MAX);
+    check_int(INT64_MAX);
+    check_int(INT64_MIN);
+    // chunks of 9 digits with inner zeros
+    check_int(1000000000ull * 1000000000ull);
+    check_int(1000000000ull * 1000000000ull + 1);
+    check_int(4294967296ull * 1000000000ull + 7);
+    for(int i = 0; i < 3000000; ++i) {
+	uint64_t num = ((uint64_t)random() << 33) ^ ((uint64_t)random() << 11) ^ random();
+	check_int(num >> (random() % 64));
+    }
+    printf("integers: OK\n");
+}
+
+void check_float(const char *format, double v) {
+    char buf[2048], ref[2048];
+    ssize_t len = rpi_snprintf(buf, sizeof(buf), format, v);
+    ssize_t ref_len = snprintf(ref, sizeof(ref), format, v);
+    if (len != ref_len || strcmp(buf, ref) != 0) {
+	printf("\"%s\" of %a: got \"%s\", glibc \"%s\"\n", format, v, buf, ref);
+	fflush(stdout);
+	assert(false);
+    }
+}
+
+void test_float(void) {
+    static const char *formats[] = {
+	"%e", "%f", "%g", "%E", "%F", "%G", "%.0e", "%.0f", "%.0g", "%#.0e",
+	"%#.0f", "%#g", "%#.3g", "%.17g", "%.12g", "%.20e", "%.3f", "%+e",
+	"% f", "%+ g", "%12.4e", "%-12.4f|", "%012.3f", "%-+14.5g|", "%014g",
+	"%40.30e", "%.40f",
+    };
+    static const double cases[] = {
+	0.0, -0.0, 1.0, -1.0, 0.5, 1.5, 2.5, 0.125, 9.5, 99.5, 0.05, 1e-5,
+	1e-4, 9.9999e-5, 123456.0, 999999.5, 1e6, 1e15, 1e16, 1e17, 1e21,
+	1e22, 1e23, 1e100, 1e-100, 1.7976931348623157e308, 5e-324,
+	2.2250738585072014e-308, 3.141592653589793, 2.675, 0.1, 0.3,
+	__builtin_inf(), -__builtin_inf(), __builtin_nan(""),
+    };
+    for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+	    // glibc prints "1.e+06" for %#g when rounding carries, C wants
+	    // "1.00000e+06"
+	    if (strchr(formats[f], '#') != NULL && cases[i] == 999999.5) continue;
+	    check_float(formats[f], cases[i]);
+	}
+	for(int i = 0; i < 20000; ++i) {
+	    union { double d; uint64_t u; } x;
+	    x.u = ((uint64_t)random() << 42) ^ ((uint64_t)random() << 21) ^ random();
+	    check_float(formats[f], x.d);
+	    // around 1
+	    x.u = (x.u & ((1ull << 52) - 1)) | (uint64_t)(1023 + random() % 60 - 30) << 52;
+	    check_float(formats[f], x.d);
+	}
+    }
+    // every precision
+    char buf[2048], ref[2048];
+    for(int p = 0; p < 400; ++p) {
+	double v = 1.0 / 3.0 * (1 + p);
+	rpi_snprintf(buf, sizeof(buf), "%.*f|%.*e|%.*g", p, v, p, v, p, v);
+	snprintf(ref, sizeof(ref), "%.*f|%.*e|%.*g", p, v, p, v, p, v);
+	assert(strcmp(buf, ref) == 0);
+    }
+    // full expansions, streamed through a small buffer
+    static const char *long_formats[] = { "%.800g", "%.760e", "%.1074f" };
+    for(size_t f = 0; f < sizeof(long_formats) / sizeof(long_formats[0]); ++f) {
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+	    check_float(long_formats[f], cases[i]);
+	}
+	for(int i = 0; i < 500; ++i) {
+	    union { double d; uint64_t u; } x;
+	    x.u = ((uint64_t)random() << 42) ^ ((uint64_t)random() << 21) ^ random();
+	    check_float(long_formats[f], x.d);
+	}
+    }
+    printf("floats: OK\n");
+}
+
+// the old conversion with a division per digit
+void old_sprint_int(Out *out, uint64_t num, int base, int width, int precision, Flags flags) {
+    const char LOWER[] = "0123456789abcdef";
+    const char UPPER[] = "0123456789ABCDEF";
+    const char *digits = (flags.upper) ? UPPER : LOWER;
+    char tmp[20];
+    if (base != 10 && base != 16) return;
+    _Bool negative = false;
+    if (flags.sign) {
+	int64_t t = num;
+	if (t < 0) {
+	    num = -t;
+	    negative = true;
+	}
+    }
+    int len = 0;
+    if (num == 0) {
+	tmp[len++] = '0';
+    }
+    while(num > 0) {
+	tmp[len++] = digits[num % base];
+	num /= base;
+    }
+    if (precision < len) precision = len;
+    if (negative || flags.plus) --width;
+    if (flags.alternate) width -= 2;
+    if (negative) {
+	buf_add('-');
+    } else if (flags.plus) {
+	buf_add(flags.space ? ' ' : '+');
+    }
+    if (flags.alternate) {
+	buf_add('0');
+	buf_add('x');
+    }
+    if (!flags.left) {
+	while(precision < width--) buf_add(flags.zeropad ? '0' : ' ');
+    }
+    while(len < precision--) {
+	buf_add(flags.zeropad ? '0' : ' ');
+	--width;
+    }
+    while(len > 0) {
+	buf_add(tmp[--len]);
+	--width;
+    }
+    while(width-- > 0) buf_add(' ');
+}
+
+void null_write(Sink *sink, const char *buf, size_t len) {
+    (void)sink;
+    asm volatile("" : : "r"(buf), "r"(len) : "memory");
+}
+
+typedef void (*Conv)(Out *, uint64_t, int, int, int, Flags);
+
+// ns per conversion of numbers below limit
+__attribute__((noipa))
+double bench_conv(Conv conv, uint64_t limit, int base) {
+    enum { N = 4096, REPS = 1000 };
+    static uint64_t nums[N];
+    srandom(1);
+    for(int i = 0; i < N; ++i) {
+	nums[i] = (((uint64_t)random() << 33) ^ ((uint64_t)random() << 11) ^ random()) % limit;
+    }
+    Sink sink = { null_write };
+    Out out = { &sink, 0, 0, { 0 } };
+    Flags flags = { false, false, false, false, false, false, false };
+    double start = now();
+    for(int r = 0; r < REPS; ++r) {
+	for(int i = 0; i < N; ++i) conv(&out, nums[i], base, 0, 0, flags);
+	out_flush(&out);
+    }
+    return (now() - start) * 1e9 / ((double)N * REPS);
+}
+
+void bench(void) {
+    static const struct { const char *name; uint64_t limit; int base; } cases[] = {
+	{ "dec < 1e4", 10000, 10 },
+	{ "dec 32 bit", 1ull << 32, 10 },
+	{ "dec 64 bit", UINT64_MAX, 10 },
+	{ "hex 32 bit", 1ull << 32, 16 },
+	{ "hex 64 bit", UINT64_MAX, 16 },
+    };
+    printf("sprint_int (ns per number)\n");
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+	double old_ns = bench_conv(old_sprint_int, cases[i].limit, cases[i].base);
+	double new_ns = bench_conv(sprint_int, cases[i].limit, cases[i].base);
+	printf("  %-10s: old %6.2f, new %6.2f, speedup %5.2fx\n",
+	       cases[i].name, old_ns, new_ns, old_ns / new_ns);
+    }
+}
+
+int main() {
+    test_int();
+    test_float();
+    test_fixed();
+    test_truncate();
+    test_stream();
+    printf("printf: OK\n");
+    bench();
+    return 0;
+}
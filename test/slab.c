@@ -0,0 +1,101 @@
+/* slab.c - Slab allocator benchmark
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Compare small object throughput of the slab caches against the plain
+ * chunk allocator using the random workload from test/memory.c.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define OCAML_RPI__STRING_H
+#define PRINTF_H
+#include "../memory.c"
+#include "util.h"
+
+#define MEM_SIZE (64*1024*1024)
+char MEM[MEM_SIZE] = { 0 };
+
+#define NUM_OPS 20000000
+#define NUM_SLOTS 4096
+void *slot[NUM_SLOTS] = { NULL };
+size_t slot_size[NUM_SLOTS] = { 0 };
+
+double run(const char *name, void *(*alloc)(size_t), void (*release)(void *)) {
+    srandom(1);
+    double start = now();
+    for(int i = 0; i < NUM_OPS; ++i) {
+	int n = random() % NUM_SLOTS;
+	if (slot[n]) {
+	    release(slot[n]);
+	}
+	size_t size = 1 + random() % SLAB_MAX;
+	slot[n] = alloc(size);
+	assert(slot[n] != NULL);
+	// only touch the first word, we measure the allocator
+	*(void**)slot[n] = slot[n];
+    }
+    for(int n = 0; n < NUM_SLOTS; ++n) {
+	if (slot[n]) {
+	    release(slot[n]);
+	    slot[n] = NULL;
+	}
+    }
+    double t = now() - start;
+    printf("%-6s: %d ops in %.3fs = %.1f Mops/s, mem_free = %#zx, mem_used = %#zx, mem_meta = %#zx\n",
+	   name, NUM_OPS, t, NUM_OPS / t / 1e6, mem_free, mem_used, mem_meta);
+    return t;
+}
+
+int main() {
+    // malloc() traces through stdio, which must not malloc() itself
+    static char stdout_buf[BUFSIZ];
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+    memory_init(MEM, MEM_SIZE, 1);
+
+    // correctness: every object keeps its contents and reports its size
+    for(int i = 0; i < 200000; ++i) {
+	int n = random() % NUM_SLOTS;
+	if (slot[n]) {
+	    check_block(slot[n], slot_size[n], (size_t)slot[n], 1);
+	    assert(!memory_is_chunk(slot[n]) == (slot_size[n] <= SLAB_MAX));
+	    assert(memory_usable_size(slot[n]) >= slot_size[n]);
+	    free(slot[n]);
+	}
+	slot_size[n] = random() % (2 * SLAB_MAX);
+	slot[n] = malloc(slot_size[n]);
+	assert(slot[n] != NULL);
+	fill_block(slot[n], slot_size[n], (size_t)slot[n]);
+    }
+    for(int n = 0; n < NUM_SLOTS; ++n) {
+	if (slot[n]) {
+	    check_block(slot[n], slot_size[n], (size_t)slot[n], 1);
+	    free(slot[n]);
+	    slot[n] = NULL;
+	}
+    }
+
+    double chunk = run("chunk", memory_chunk_alloc, memory_chunk_free);
+    double slab = run("slab", memory_slab_alloc, memory_slab_free);
+    printf("speedup: %.2fx\n", chunk / slab);
+    return 0;
+}
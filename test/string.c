@@ -0,0 +1,406 @@
+/* string.c - string and memory function test
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Check the kernel string functions against glibc for all alignments
+ * and many sizes, then benchmark them against the old byte loops.
+ * The kernel versions are renamed to rpi_* so both can be called.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+// glibc versions as reference
+void *(*libc_memcpy)(void *, const void *, size_t) = memcpy;
+void *(*libc_memmove)(void *, const void *, size_t) = memmove;
+int (*libc_memcmp)(const void *, const void *, size_t) = memcmp;
+void *(*libc_memset)(void *, int, size_t) = memset;
+size_t (*libc_strlen)(const char *) = strlen;
+int (*libc_strcmp)(const char *, const char *) = strcmp;
+char *(*libc_strcpy)(char *, const char *) = strcpy;
+char *(*libc_strcat)(char *, const char *) = strcat;
+
+#define memmove rpi_memmove
+#define memcpy rpi_memcpy
+#define memset rpi_memset
+#define memcmp rpi_memcmp
+#define strcat rpi_strcat
+#define strcmp rpi_strcmp
+#define strcpy rpi_strcpy
+#define strlen rpi_strlen
+#include "../string.c"
+#include "util.h"
+
+#define MAX_SIZE (1024*1024)
+#define GUARD 64
+unsigned char src_buf[MAX_SIZE + 4 * GUARD];
+unsigned char dst_buf[MAX_SIZE + 4 * GUARD];
+unsigned char ref_buf[MAX_SIZE + 4 * GUARD];
+
+// the old byte loops, kept out of line and scalar like on the ARM1176
+#define OLD __attribute__((noipa, optimize("no-tree-vectorize")))
+
+OLD void *old_memcpy(void *dest, const void *src, size_t n) {
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+    while(n-- > 0) *d++ = *s++;
+    return dest;
+}
+
+OLD void *old_memmove(void *dest, const void *src, size_t n) {
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+    if (d < s || (size_t)(d - s) >= n) {
+	while(n-- > 0) *d++ = *s++;
+    } else {
+	d += n;
+	s += n;
+	while(n-- > 0) *--d = *--s;
+    }
+    return dest;
+}
+
+OLD void *old_memset(void *s, int c, size_t n) {
+    char *p = (char *)s;
+    while(n-- > 0) *p++ = c;
+    return s;
+}
+
+// byte loops as baseline for the string functions
+OLD int old_memcmp(const void *s1, const void *s2, size_t n) {
+    const unsigned char *p = (const unsigned char *)s1;
+    const unsigned char *q = (const unsigned char *)s2;
+    while(n-- > 0) {
+	if (*p != *q) return *p - *q;
+	++p;
+	++q;
+    }
+    return 0;
+}
+
+OLD size_t old_strlen(const char *s) {
+    size_t res = 0;
+    while(*s++) ++res;
+    return res;
+}
+
+OLD int old_strcmp(const char *s1, const char *s2) {
+    const unsigned char *p = (const unsigned char *)s1;
+    const unsigned char *q = (const unsigned char *)s2;
+    while(*p == *q && *p != 0) {
+	++p;
+	++q;
+    }
+    return *p - *q;
+}
+
+void fill_random(unsigned char *p, size_t n) {
+    for(size_t i = 0; i < n; ++i) p[i] = random();
+}
+
+void test_memcpy(size_t n, size_t doff, size_t soff) {
+    size_t len = n + 2 * GUARD;
+    fill_random(src_buf, len);
+    fill_random(dst_buf, len);
+    libc_memcpy(ref_buf, dst_buf, len);
+    void *res = memcpy(dst_buf + GUARD + doff, src_buf + GUARD + soff, n);
+    libc_memcpy(ref_buf + GUARD + doff, src_buf + GUARD + soff, n);
+    assert(res == dst_buf + GUARD + doff);
+    assert(libc_memcmp(dst_buf, ref_buf, len) == 0);
+}
+
+// overlapping copy within one buffer, delta may be negative
+void test_memmove(size_t n, size_t off, long delta) {
+    size_t len = n + 4 * GUARD;
+    fill_random(dst_buf, len);
+    libc_memcpy(ref_buf, dst_buf, len);
+    unsigned char *s = dst_buf + GUARD + off;
+    void *res = memmove(s + delta, s, n);
+    libc_memmove(ref_buf + GUARD + off + delta, ref_buf + GUARD + off, n);
+    assert(res == s + delta);
+    assert(libc_memcmp(dst_buf, ref_buf, len) == 0);
+}
+
+void test_memset(size_t n, size_t off, int c) {
+    size_t len = n + 2 * GUARD;
+    fill_random(dst_buf, len);
+    libc_memcpy(ref_buf, dst_buf, len);
+    void *res = memset(dst_buf + GUARD + off, c, n);
+    libc_memset(ref_buf + GUARD + off, c, n);
+    assert(res == dst_buf + GUARD + off);
+    assert(libc_memcmp(dst_buf, ref_buf, len) == 0);
+}
+
+// non-zero random bytes with a terminator at n
+void fill_string(unsigned char *p, size_t n) {
+    for(size_t i = 0; i < n; ++i) p[i] = 1 + random() % 255;
+    p[n] = 0;
+}
+
+int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+void test_memcmp(size_t n, size_t off1, size_t off2) {
+    unsigned char *p = src_buf + GUARD + off1, *q = dst_buf + GUARD + off2;
+    fill_random(p, n);
+    libc_memcpy(q, p, n);
+    assert(memcmp(p, q, n) == 0);
+    if (n == 0) return;
+    // differ in one byte, the sign must match glibc
+    size_t i = random() % n;
+    q[i] = random();
+    assert(sign(memcmp(p, q, n)) == sign(libc_memcmp(p, q, n)));
+    assert(sign(memcmp(q, p, n)) == sign(libc_memcmp(q, p, n)));
+    // differences past n do not count
+    assert(memcmp(p, q, i) == 0);
+}
+
+void test_strings(size_t n, size_t off1, size_t off2) {
+    char *p = (char *)src_buf + GUARD + off1, *q = (char *)dst_buf + GUARD + off2;
+    fill_string((unsigned char *)p, n);
+    assert(strlen(p) == n);
+    libc_memcpy(q, p, n + 1);
+    assert(strcmp(p, q) == 0);
+    if (n > 0) {
+	size_t i = random() % n;
+	q[i] = random(); // may also end q early
+	assert(sign(strcmp(p, q)) == sign(libc_strcmp(p, q)));
+	assert(sign(strcmp(q, p)) == sign(libc_strcmp(q, p)));
+	q[i] = p[i];
+	q[n] = 'x'; // p is a prefix of q
+	q[n + 1] = 0;
+	assert(strcmp(p, q) < 0 && strcmp(q, p) > 0);
+    }
+
+    // strcpy and strcat including the terminator, nothing beyond
+    size_t len = n + 2 * GUARD;
+    fill_random(dst_buf, len);
+    libc_memcpy(ref_buf, dst_buf, len);
+    assert(strcpy((char *)dst_buf + GUARD + off2, p) == (char *)dst_buf + GUARD + off2);
+    libc_strcpy((char *)ref_buf + GUARD + off2, p);
+    assert(libc_memcmp(dst_buf, ref_buf, len) == 0);
+
+    size_t head = random() % 16;
+    fill_random(dst_buf, len + 16);
+    fill_string(dst_buf + GUARD, head);
+    libc_memcpy(ref_buf, dst_buf, len + 16);
+    assert(strcat((char *)dst_buf + GUARD, p) == (char *)dst_buf + GUARD);
+    libc_strcat((char *)ref_buf + GUARD, p);
+    assert(libc_memcmp(dst_buf, ref_buf, len + 16) == 0);
+}
+
+// strings that end right before an unmapped page must not fault
+void test_page_end(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *mem = mmap(NULL, 3 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mem != MAP_FAILED);
+    assert(mprotect(mem + page, page, PROT_NONE) == 0);
+    char *end = mem + page, *other = mem + 3 * page;
+    for(size_t n = 0; n < 64; ++n) {
+	for(size_t off = 0; off < 8; ++off) {
+	    char *p = end - n - 1, *q = other - n - 1 - off;
+	    fill_string((unsigned char *)p, n);
+	    assert(strlen(p) == n);
+	    libc_memcpy(q, p, n + 1);
+	    assert(strcmp(p, q) == 0 && strcmp(q, p) == 0);
+	    assert(memcmp(p, q, n + 1) == 0);
+	    char *r = mem + 2 * page + off;
+	    assert(strcpy(r, p) == r && libc_strcmp(r, p) == 0);
+	}
+    }
+    munmap(mem, 3 * page);
+}
+
+uint64_t cycles(void) {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+typedef void *(*Copy)(void *, const void *, size_t);
+
+// copy n bytes repeatedly, returns bytes per ns and bytes per cycle
+__attribute__((noipa))
+void bench_copy(Copy copy, size_t n, size_t doff, size_t soff, double *per_ns, double *per_cycle) {
+    size_t reps = 64 * 1024 * 1024 / n;
+    if (reps > 1000000) reps = 1000000;
+    double start = now();
+    uint64_t c0 = cycles();
+    for(size_t i = 0; i < reps; ++i) {
+	copy(dst_buf + GUARD + doff, src_buf + GUARD + soff, n);
+	// keep the compiler from dropping the copies
+	asm volatile("" : : "r"(dst_buf) : "memory");
+    }
+    uint64_t c1 = cycles();
+    double t = now() - start;
+    *per_ns = (double)n * reps / (t * 1e9);
+    *per_cycle = (c1 > c0) ? (double)n * reps / (c1 - c0) : 0.0;
+}
+
+void bench(const char *name, Copy old, Copy new, size_t doff, size_t soff) {
+    printf("%s, dest + %zd, src + %zd (bytes/ns, bytes/cycle)\n", name, doff, soff);
+    for(size_t n = 16; n <= MAX_SIZE; n *= 4) {
+	double old_ns, old_cycle, new_ns, new_cycle;
+	bench_copy(old, n, doff, soff, &old_ns, &old_cycle);
+	bench_copy(new, n, doff, soff, &new_ns, &new_cycle);
+	printf("  %8zd: old %6.2f %6.2f, new %6.2f %6.2f, speedup %5.2fx\n",
+	       n, old_ns, old_cycle, new_ns, new_cycle, new_ns / old_ns);
+    }
+}
+
+typedef void *(*Fill)(void *, int, size_t);
+
+__attribute__((noipa))
+void bench_fill(Fill fill, size_t n, size_t off, double *per_ns, double *per_cycle) {
+    size_t reps = 64 * 1024 * 1024 / n;
+    if (reps > 1000000) reps = 1000000;
+    double start = now();
+    uint64_t c0 = cycles();
+    for(size_t i = 0; i < reps; ++i) {
+	fill(dst_buf + GUARD + off, i, n);
+	asm volatile("" : : "r"(dst_buf) : "memory");
+    }
+    uint64_t c1 = cycles();
+    double t = now() - start;
+    *per_ns = (double)n * reps / (t * 1e9);
+    *per_cycle = (c1 > c0) ? (double)n * reps / (c1 - c0) : 0.0;
+}
+
+void bench_memset(size_t off) {
+    printf("memset, s + %zd (bytes/ns, bytes/cycle)\n", off);
+    for(size_t n = 16; n <= MAX_SIZE; n *= 4) {
+	double old_ns, old_cycle, new_ns, new_cycle;
+	bench_fill(old_memset, n, off, &old_ns, &old_cycle);
+	bench_fill(memset, n, off, &new_ns, &new_cycle);
+	printf("  %8zd: old %6.2f %6.2f, new %6.2f %6.2f, speedup %5.2fx\n",
+	       n, old_ns, old_cycle, new_ns, new_cycle, new_ns / old_ns);
+    }
+}
+
+typedef size_t (*Len)(const char *);
+typedef int (*Cmp)(const char *, const char *);
+typedef int (*MemCmp)(const void *, const void *, size_t);
+
+// strings of length n at src and dst, bench = 0: strlen, 1: strcmp, 2: memcmp
+__attribute__((noipa))
+double bench_scan(void *fn, int bench, size_t n, size_t soff, double *per_cycle) {
+    char *p = (char *)src_buf + GUARD, *q = (char *)dst_buf + GUARD + soff;
+    fill_string((unsigned char *)p, n);
+    libc_memcpy(q, p, n + 1);
+    size_t reps = 64 * 1024 * 1024 / n;
+    if (reps > 1000000) reps = 1000000;
+    double start = now();
+    uint64_t c0 = cycles();
+    for(size_t i = 0; i < reps; ++i) {
+	size_t r;
+	switch(bench) {
+	case 0: r = ((Len)fn)(p); break;
+	case 1: r = ((Cmp)fn)(p, q); break;
+	default: r = ((MemCmp)fn)(p, q, n); break;
+	}
+	asm volatile("" : : "r"(r) : "memory");
+    }
+    uint64_t c1 = cycles();
+    double t = now() - start;
+    *per_cycle = (c1 > c0) ? (double)n * reps / (c1 - c0) : 0.0;
+    return (double)n * reps / (t * 1e9);
+}
+
+void bench_string(const char *name, void *old, void *new, int bench, size_t soff) {
+    printf("%s, s2 + %zd (bytes/ns, bytes/cycle)\n", name, soff);
+    for(size_t n = 16; n <= MAX_SIZE / 2; n *= 4) {
+	double old_cycle, new_cycle;
+	double old_ns = bench_scan(old, bench, n, soff, &old_cycle);
+	double new_ns = bench_scan(new, bench, n, soff, &new_cycle);
+	printf("  %8zd: old %6.2f %6.2f, new %6.2f %6.2f, speedup %5.2fx\n",
+	       n, old_ns, old_cycle, new_ns, new_cycle, new_ns / old_ns);
+    }
+}
+
+int main() {
+    for(size_t n = 0; n < 300; ++n) {
+	for(size_t doff = 0; doff < 8; ++doff) {
+	    for(size_t soff = 0; soff < 8; ++soff) {
+		test_memcpy(n, doff, soff);
+	    }
+	}
+	for(size_t off = 0; off < 8; ++off) {
+	    for(long delta = -GUARD / 2; delta <= GUARD / 2; ++delta) {
+		test_memmove(n, off, delta);
+	    }
+	}
+    }
+    for(int i = 0; i < 200; ++i) {
+	size_t n = random() % MAX_SIZE;
+	test_memcpy(n, random() % GUARD, random() % GUARD);
+	test_memmove(n, random() % GUARD, (long)(random() % (GUARD + 1)) - GUARD / 2);
+    }
+    printf("memcpy, memmove: OK\n");
+
+    for(size_t n = 0; n < 300; ++n) {
+	for(size_t off = 0; off < 8; ++off) {
+	    test_memset(n, off, 0);
+	    test_memset(n, off, 0xa5);
+	    test_memset(n, off, -1);
+	    test_memset(n, off, 0x1234); // only the low byte counts
+	}
+    }
+    for(int i = 0; i < 200; ++i) {
+	test_memset(random() % MAX_SIZE, random() % GUARD, random());
+    }
+    printf("memset: OK\n");
+
+    for(size_t n = 0; n < 300; ++n) {
+	for(size_t off1 = 0; off1 < 8; ++off1) {
+	    for(size_t off2 = 0; off2 < 8; ++off2) {
+		test_memcmp(n, off1, off2);
+		test_strings(n, off1, off2);
+	    }
+	}
+    }
+    for(int i = 0; i < 100; ++i) {
+	size_t n = random() % (MAX_SIZE - 2);
+	test_memcmp(n, random() % GUARD, random() % GUARD);
+	test_strings(n, random() % GUARD, random() % GUARD);
+    }
+    test_page_end();
+    printf("memcmp, strlen, strcmp, strcpy, strcat: OK\n");
+
+    bench("memcpy", old_memcpy, memcpy, 0, 0);
+    bench("memcpy", old_memcpy, memcpy, 0, 3);
+    bench("memmove", old_memmove, memmove, 0, 0);
+    bench_memset(0);
+    bench_memset(3);
+    bench_string("strlen", old_strlen, strlen, 0, 0);
+    bench_string("strcmp", old_strcmp, strcmp, 1, 0);
+    bench_string("strcmp", old_strcmp, strcmp, 1, 3);
+    bench_string("memcmp", old_memcmp, memcmp, 2, 0);
+    bench_string("memcmp", old_memcmp, memcmp, 2, 3);
+    return 0;
+}
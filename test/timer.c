@@ -0,0 +1,187 @@
+/* timer.c - Timer wheel test case and benchmark
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Random timers on all levels and beyond, with cancels and periodic
+ * timers re-adding themselves, driven tickless from timer_next() and in
+ * random steps. Every timer must expire once, on its tick, in order.
+ * Then time add and expire for growing numbers of timers.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../timer.c"
+#include "util.h"
+
+#define NUM_TIMERS 10000
+#define NUM_ROUNDS 20
+
+typedef struct Test {
+    Timer timer;
+    uint64_t due;      // tick it must expire on
+    uint64_t period;   // re-added this much later, 0 for one-shot
+    int armed;
+} Test;
+
+Test tests[NUM_TIMERS];
+uint64_t last_tick;
+uint64_t advance_now;
+
+// expire on the tick, or the next one processed if already due
+uint64_t due(uint64_t expires) {
+    uint64_t time = timer_time();
+    return expires < time ? time : expires;
+}
+
+void add(Test *test, uint64_t expires) {
+    test->due = due(expires);
+    test->armed = 1;
+    timer_add(&test->timer, expires);
+}
+
+void cancel(Test *test) {
+    timer_cancel(&test->timer);
+    test->armed = 0;
+}
+
+void fire(Timer *timer) {
+    Test *test = CONTAINER(Test, timer, timer);
+    uint64_t tick = timer_time() - 1;
+    assert(!timer_is_pending(timer));
+    assert(test->armed);
+    assert(tick == test->due);
+    assert(tick <= advance_now);
+    assert(tick >= last_tick);
+    last_tick = tick;
+    test->armed = 0;
+    if (test->period != 0) add(test, tick + test->period);
+    // cancel a random timer, possibly one expiring on this tick
+    if (random() % 8 == 0) {
+	Test *other = &tests[random() % NUM_TIMERS];
+	if (other != test && timer_is_pending(&other->timer)) {
+	    cancel(other);
+	}
+    }
+}
+
+uint64_t random_delta(void) {
+    switch(random() % 4) {
+    case 0: return random() % TIMER_SLOTS;
+    case 1: return random() % (TIMER_SLOTS * TIMER_SLOTS);
+    case 2: return random() % (1ull << (TIMER_LEVELS * TIMER_SLOT_BITS));
+    default: return random() % (1ull << 26);
+    }
+}
+
+void advance(uint64_t now) {
+    advance_now = now;
+    timer_advance(now);
+    // nothing due is left behind
+    assert(timer_next() > now);
+    assert(timer_time() == now + 1);
+}
+
+void check(int tickless) {
+    timer_init(TIMER_SLOTS + random() % 1000000);
+    last_tick = 0;
+    for(int i = 0; i < NUM_TIMERS; ++i) {
+	Test *test = &tests[i];
+	timer_setup(&test->timer, fire);
+	test->period = (random() % 16 == 0) ? 4096 + random_delta() : 0;
+	add(test, timer_time() + random_delta());
+    }
+    assert(timer_pending == NUM_TIMERS);
+    for(int i = 0; i < NUM_TIMERS / 10; ++i) {
+	cancel(&tests[random() % NUM_TIMERS]);
+    }
+    size_t wakeups = 0;
+    size_t expired = timer_expired;
+    size_t cascaded = timer_cascaded;
+    uint64_t end = timer_time() + (1ull << 27);
+    while (timer_time() <= end) {
+	uint64_t next = timer_next();
+	if (tickless) {
+	    if (next > end) break;
+	    advance(next);
+	} else {
+	    advance(timer_time() + random() % 2000);
+	}
+	++wakeups;
+	if (random() % 64 == 0) {
+	    // a stray add from outside the callbacks
+	    Test *test = &tests[random() % NUM_TIMERS];
+	    if (!timer_is_pending(&test->timer)) {
+		add(test, timer_time() + random_delta() - TIMER_SLOTS);
+	    }
+	}
+    }
+    // the rest is not due yet
+    for(int i = 0; i < NUM_TIMERS; ++i) {
+	Test *test = &tests[i];
+	assert(test->armed == timer_is_pending(&test->timer));
+	if (test->armed) {
+	    assert(test->due >= timer_time());
+	    cancel(test);
+	}
+    }
+    assert(timer_pending == 0);
+    assert(timer_next() == UINT64_MAX);
+    if (tickless) {
+	// a wakeup expires or cascades something
+	printf("tickless: %zu wakeups, %zu cascades\n",
+	       wakeups, timer_cascaded - cascaded);
+	assert(wakeups <= timer_expired - expired + timer_cascaded - cascaded);
+    }
+}
+
+void count(Timer *timer) {
+    (void)timer;
+}
+
+Timer bench_timers[100000];
+
+void bench(int num) {
+    timer_init(0);
+    double start = now();
+    for(int round = 0; round < NUM_ROUNDS; ++round) {
+	for(int i = 0; i < num; ++i) {
+	    timer_setup(&bench_timers[i], count);
+	    timer_add(&bench_timers[i], timer_time() + random() % (1 << 20));
+	}
+	timer_advance(timer_time() + (1 << 20));
+    }
+    double total = now() - start;
+    printf("%6d timers: %5.1f ns per add + expire, %4.2f cascades per timer\n",
+	   num, total * 1e9 / num / NUM_ROUNDS,
+	   (double)timer_cascaded / num / NUM_ROUNDS);
+}
+
+int main() {
+    for(int round = 0; round < 4; ++round) {
+	check(round & 1);
+    }
+    printf("%zu timers expired\n", timer_expired);
+    for(int num = 1000; num <= 100000; num *= 10) {
+	timer_cascaded = 0;
+	bench(num);
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* trace.c - trace decoder test
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Decode records against a fake kernel image: argument conversions,
+ * strings and symbols from the image, raw dumps embedded in a serial
+ * log and the ring buffer in a memory dump.
+ */
+
+#define main trace_decode_main
+#include "../tools/trace_decode.c"
+#undef main
+
+#include <assert.h>
+
+enum { RODATA = 0xC0010000, DATA = 0xC0020000 };
+
+// fake .rodata, strings at known offsets
+char rodata[256];
+uint32_t rodata_used = 0;
+
+uint32_t add_string(const char *str) {
+    uint32_t addr = RODATA + rodata_used;
+    strcpy(rodata + rodata_used, str);
+    rodata_used += strlen(str) + 1;
+    return addr;
+}
+
+Symbol fake_symbols[] = {
+    { 0xC0008000, 0x40, "Start" },
+    { 0xC0008040, 0x0, "_label" },
+    { 0xC0009000, 0x100, "schedule" },
+    { DATA, 4, "trace_head" },
+    { DATA + 4, 4, "trace_tail" },
+    { DATA + 8, 4 * sizeof(RawRecord), "trace_ring" },
+};
+
+char output[4096];
+
+// decode one record into output
+const char *decode(RawRecord *rec) {
+    FILE *out = fmemopen(output, sizeof(output), "w");
+    print_record(out, rec);
+    fclose(out);
+    return output;
+}
+
+void test_format(void) {
+    uint32_t name = add_string("schedule");
+    RawRecord rec = { 42, add_string("%s(%d, %u, %#8.8x) %%"), { name, -5, -5, 0xbeef } };
+    assert(strcmp(decode(&rec), "[        42] schedule(-5, 4294967291, 0x0000beef) %\n") == 0);
+    rec.fmt = add_string("%c%x%X");
+    rec.arg[0] = 'z';
+    rec.arg[1] = 255;
+    rec.arg[2] = 255;
+    assert(strcmp(decode(&rec), "[        42] zffFF\n") == 0);
+
+    // lengths and widths
+    rec.fmt = add_string("%hhd|%hu|%5d|%-5zd|");
+    rec.arg[0] = 0x1ff;
+    rec.arg[1] = 0x12345;
+    rec.arg[2] = 7;
+    rec.arg[3] = 8;
+    assert(strcmp(decode(&rec), "[        42] -1|9029|    7|8    |\n") == 0);
+    rec.fmt = add_string("%*d|%.3s|%d");
+    rec.arg[0] = 4;
+    rec.arg[1] = 7;
+    rec.arg[2] = name;
+    assert(strcmp(decode(&rec), "[        42]    7|sch|8\n") == 0);
+
+    // 64 bit values take two words, low first
+    rec.fmt = add_string("%lld %llx");
+    rec.arg[0] = 0xfffffffe;
+    rec.arg[1] = 0xffffffff;
+    rec.arg[2] = 0x89abcdef;
+    rec.arg[3] = 0x01234567;
+    assert(strcmp(decode(&rec), "[        42] -2 123456789abcdef\n") == 0);
+
+    // pointers get the symbol they point into
+    rec.fmt = add_string("%p %p %p %p");
+    rec.arg[0] = 0xC0009010;
+    rec.arg[1] = 0xC0008000;
+    rec.arg[2] = 0xC0008041;
+    rec.arg[3] = 0xC0008040;
+    assert(strcmp(decode(&rec), "[        42] 0xc0009010 <schedule+0x10> 0xc0008000 <Start>"
+		  " 0xc0008041 0xc0008040 <_label>\n") == 0);
+
+    // strings outside the image and a bad format pointer
+    rec.fmt = add_string("%s|%q|%");
+    rec.arg[0] = 0x1234;
+    assert(strcmp(decode(&rec), "[        42] <0x1234>|%q|%\n") == 0);
+    rec.fmt = 0xdead;
+    assert(strncmp(decode(&rec), "[        42] <bad format 0xdead>", 32) == 0);
+    printf("format: OK\n");
+}
+
+void test_log(void) {
+    char log[1024];
+    size_t len = 0;
+    uint32_t fmt = add_string("tick %u");
+    len += sprintf(log, "booting\n# trace: raw\n");
+    TraceRawHeader header = { TRACE_RAW_MAGIC, sizeof(RawRecord), 2, 3 };
+    memcpy(log + len, &header, sizeof(header));
+    len += sizeof(header);
+    for(uint32_t i = 0; i < 2; ++i) {
+	RawRecord rec = { 1000 + i, fmt, { i, 0, 0, 0 } };
+	memcpy(log + len, &rec, sizeof(rec));
+	len += sizeof(rec);
+    }
+    len += sprintf(log + len, "done\n");
+
+    FILE *out = fmemopen(output, sizeof(output), "w");
+    assert(decode_log(out, log, len) == 1);
+    fclose(out);
+    assert(strcmp(output, "booting\n# trace: raw\n# trace: 3 records lost\n"
+		  "[      1000] tick 0\n[      1001] tick 1\ndone\n") == 0);
+
+    // a dump cut short is an error
+    out = fmemopen(output, sizeof(output), "w");
+    assert(decode_log(out, log, len - 10) == -1);
+    fclose(out);
+    printf("log: OK\n");
+}
+
+void test_memory(void) {
+    // trace_head, trace_tail and a ring of 4 records after 6 were written
+    char mem[8 + 4 * sizeof(RawRecord)];
+    uint32_t fmt = add_string("n = %d");
+    uint32_t head = 6;
+    memcpy(mem, &head, 4);
+    for(uint32_t i = 2; i < 6; ++i) {
+	RawRecord rec = { i, fmt, { i, 0, 0, 0 } };
+	memcpy(mem + 8 + (i % 4) * sizeof(rec), &rec, sizeof(rec));
+    }
+    FILE *out = fmemopen(output, sizeof(output), "w");
+    assert(decode_memory(out, mem, sizeof(mem), DATA));
+    fclose(out);
+    assert(strcmp(output, "# trace: 2 records lost\n[         2] n = 2\n[         3] n = 3\n"
+		  "[         4] n = 4\n[         5] n = 5\n") == 0);
+
+    // a dump that does not contain the ring
+    out = fmemopen(output, sizeof(output), "w");
+    assert(!decode_memory(out, mem, sizeof(mem) - 1, DATA));
+    fclose(out);
+    printf("memory: OK\n");
+}
+
+int main() {
+    sections[0].addr = RODATA;
+    sections[0].size = sizeof(rodata);
+    sections[0].data = rodata;
+    num_sections = 1;
+    symbols = fake_symbols;
+    num_symbols = sizeof(fake_symbols) / sizeof(fake_symbols[0]);
+    qsort(symbols, num_symbols, sizeof(Symbol), symbol_cmp);
+
+    test_format();
+    test_log();
+    test_memory();
+    return 0;
+}
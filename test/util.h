@@ -0,0 +1,76 @@
+/* util.h - Helpers shared by the test cases
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Every test is a single source file, so this defines the helpers right
+ * here: include it once, after the kernel sources under test.
+ */
+
+#ifndef OCAML_RPI__TEST_UTIL_H
+#define OCAML_RPI__TEST_UTIL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+
+#define BLOCK_GUARD 32 // words checked at each end of a block
+
+// the kernel busy waits on the console, no need here
+void delay(uint32_t count) {
+    (void)count;
+}
+
+// monotonic time in ns
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// monotonic time in seconds
+double now(void) {
+    return now_ns() * 1e-9;
+}
+
+// mark the first and last BLOCK_GUARD words of a block with id
+void fill_block(void *mem, size_t size, size_t id) {
+    size_t *p = (size_t *)mem;
+    size_t words = size / sizeof(size_t);
+    for(size_t i = 0; i < words; ++i) {
+	if (i == BLOCK_GUARD && words > 2 * BLOCK_GUARD) i = words - BLOCK_GUARD;
+	p[i] = id;
+    }
+}
+
+// check the marks of fill_block(), the last ones only with tail set
+void check_block(void *mem, size_t size, size_t id, int tail) {
+    size_t *p = (size_t *)mem;
+    size_t words = size / sizeof(size_t);
+    for(size_t i = 0; i < words; ++i) {
+	if (i == BLOCK_GUARD) {
+	    if (!tail) break;
+	    if (words > 2 * BLOCK_GUARD) i = words - BLOCK_GUARD;
+	}
+	if (p[i] != id) {
+	    fprintf(stderr, "ERROR: memory contents changed in block %p [%#zx] @ %p\n", mem, size, &p[i]);
+	    assert(0==1);
+	}
+    }
+}
+
+#endif // #ifndef OCAML_RPI__TEST_UTIL_H
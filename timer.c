@@ -0,0 +1,163 @@
+/* timer.c - Hierarchical timer wheel
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * A timer due delta ticks after wheel_time goes to the level whose slots
+ * are shorter than delta, into the slot covering its tick. A slot on
+ * level n is cascaded at the first tick of its span, which lies in the
+ * TIMER_SLOTS slots from the current one on, so slots never get mixed
+ * up between rounds.
+ */
+
+#include "timer.h"
+
+// timers expiring on the tick being processed
+#define TIMER_EXPIRING TIMER_LEVELS
+
+static Timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t wheel_used[TIMER_LEVELS]; // bit n is set while wheel[l][n] has a timer
+static uint64_t wheel_time = 0; // next tick to process
+static Timer *expiring = NULL;
+
+size_t timer_pending = 0;
+size_t timer_expired = 0;
+size_t timer_cascaded = 0;
+
+// ticks covered by a slot on level
+static inline int level_shift(int level) {
+    return level * TIMER_SLOT_BITS;
+}
+
+void timer_init(uint64_t now) {
+    for(int l = 0; l < TIMER_LEVELS; ++l) {
+	for(int s = 0; s < TIMER_SLOTS; ++s) wheel[l][s] = NULL;
+	wheel_used[l] = 0;
+    }
+    expiring = NULL;
+    wheel_time = now;
+    timer_pending = 0;
+}
+
+static void timer_place(Timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel_time) expires = wheel_time;
+    uint64_t delta = expires - wheel_time;
+    int level = 0;
+    if (delta >= TIMER_SLOTS) {
+	level = (63 - __builtin_clzll(delta)) / TIMER_SLOT_BITS;
+	if (level >= TIMER_LEVELS) {
+	    // too far out: wait in the last slot of the top level
+	    level = TIMER_LEVELS - 1;
+	    expires = wheel_time + (1ull << level_shift(TIMER_LEVELS)) - 1;
+	}
+    }
+    int slot = (expires >> level_shift(level)) & (TIMER_SLOTS - 1);
+    timer->level = level;
+    timer->slot = slot;
+    DLIST_PUSH(&wheel[level][slot], timer, link);
+    wheel_used[level] |= 1ull << slot;
+}
+
+void timer_add(Timer *timer, uint64_t expires) {
+    timer->expires = expires;
+    timer_place(timer);
+    ++timer_pending;
+}
+
+void timer_cancel(Timer *timer) {
+    if (timer->level == TIMER_IDLE) return;
+    if (timer->level == TIMER_EXPIRING) {
+	DLIST_REMOVE_FROM(&expiring, timer, link);
+    } else {
+	Timer **list = &wheel[timer->level][timer->slot];
+	DLIST_REMOVE_FROM(list, timer, link);
+	if (*list == NULL) wheel_used[timer->level] &= ~(1ull << timer->slot);
+    }
+    timer->level = TIMER_IDLE;
+    --timer_pending;
+}
+
+// move the timers of a slot to the levels below
+static void timer_cascade(int level, int slot) {
+    Timer **list = &wheel[level][slot];
+    wheel_used[level] &= ~(1ull << slot);
+    while (*list != NULL) {
+	Timer *timer = DLIST_POP(list, link);
+	timer_place(timer);
+	++timer_cascaded;
+    }
+}
+
+// rotate bits right so bit n lands in bit 0
+static inline uint64_t rotate(uint64_t bits, int n) {
+    if (n == 0) return bits;
+    return (bits >> n) | (bits << (64 - n));
+}
+
+uint64_t timer_next(void) {
+    uint64_t next = UINT64_MAX;
+    for(int l = 0; l < TIMER_LEVELS; ++l) {
+	if (wheel_used[l] == 0) continue;
+	int shift = level_shift(l);
+	// first slot starting at or after wheel_time
+	uint64_t index = (wheel_time + (1ull << shift) - 1) >> shift;
+	int offset = __builtin_ctzll(rotate(wheel_used[l], index & (TIMER_SLOTS - 1)));
+	uint64_t tick = (index + offset) << shift;
+	if (tick < next) next = tick;
+    }
+    return next;
+}
+
+uint64_t timer_time(void) {
+    return wheel_time;
+}
+
+void timer_advance(uint64_t now) {
+    while (1) {
+	uint64_t tick = timer_next();
+	if (tick > now) break;
+	wheel_time = tick;
+	// higher levels first, they may refill the slots below
+	for(int l = TIMER_LEVELS - 1; l > 0; --l) {
+	    int shift = level_shift(l);
+	    if ((tick & ((1ull << shift) - 1)) != 0) continue;
+	    int slot = (tick >> shift) & (TIMER_SLOTS - 1);
+	    if (wheel_used[l] & (1ull << slot)) timer_cascade(l, slot);
+	}
+	/* Take the slot out first: timers added by the callbacks are
+	 * placed from the next tick on and may land in this slot again.
+	 */
+	int slot = tick & (TIMER_SLOTS - 1);
+	expiring = wheel[0][slot];
+	wheel[0][slot] = NULL;
+	wheel_used[0] &= ~(1ull << slot);
+	if (expiring != NULL) {
+	    DLIST_ITERATOR_BEGIN(expiring, link, it) {
+		it->level = TIMER_EXPIRING;
+	    } DLIST_ITERATOR_END(it);
+	}
+	wheel_time = tick + 1;
+	while (expiring != NULL) {
+	    Timer *timer = DLIST_POP(&expiring, link);
+	    timer->level = TIMER_IDLE;
+	    --timer_pending;
+	    ++timer_expired;
+	    timer->fn(timer);
+	}
+    }
+    if (wheel_time <= now) wheel_time = now + 1;
+}
@@ -0,0 +1,93 @@
+/* timer.h - Hierarchical timer wheel
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Timers expire at an absolute time in ticks of the wheel. Level 0 has a
+ * slot per tick for the next TIMER_SLOTS ticks, each level above has
+ * slots TIMER_SLOTS times as long. When time reaches the start of a slot
+ * on a higher level its timers are cascaded to the levels below, so a
+ * timer moves at most TIMER_LEVELS - 1 times before it expires. Timers
+ * beyond the top level wait in its last slot and are placed again.
+ *
+ * Adding, cancelling and expiring a timer is O(1). A bitmap of the used
+ * slots per level gives the next tick with something to do without
+ * looking at the empty ones, so the wheel can be driven tickless: run
+ * timer_advance() when the clock reaches timer_next().
+ *
+ * Nothing here locks, the kernel only touches the wheel with IRQs
+ * disabled.
+ */
+
+#ifndef OCAML_RPI__TIMER_H
+#define OCAML_RPI__TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "list.h"
+
+enum {
+    TIMER_LEVELS = 4,
+    TIMER_SLOT_BITS = 6,
+    TIMER_SLOTS = 1 << TIMER_SLOT_BITS,
+};
+
+// level of a timer that is not in the wheel
+#define TIMER_IDLE (-1)
+
+typedef struct Timer Timer;
+struct Timer {
+    DList link;
+    uint64_t expires;              // tick to expire at
+    void (*fn)(Timer *timer);      // called once expired, the timer is idle again
+    int level;                     // TIMER_IDLE unless pending
+    int slot;
+};
+
+// statistics
+extern size_t timer_pending;
+extern size_t timer_expired;
+extern size_t timer_cascaded;
+
+// start the wheel over at now, forgetting all timers
+void timer_init(uint64_t now);
+
+static inline void timer_setup(Timer *timer, void (*fn)(Timer *timer)) {
+    DLIST_INIT(timer, link);
+    timer->fn = fn;
+    timer->level = TIMER_IDLE;
+}
+
+static inline int timer_is_pending(const Timer *timer) {
+    return timer->level != TIMER_IDLE;
+}
+
+// arm an idle timer, one that is already due expires on the next advance
+void timer_add(Timer *timer, uint64_t expires);
+
+// disarm a pending timer, idle ones are left alone
+void timer_cancel(Timer *timer);
+
+// expire all timers due at or before now, in order of their ticks
+void timer_advance(uint64_t now);
+
+// first tick with a timer to expire or cascade, UINT64_MAX if none
+uint64_t timer_next(void);
+
+// ticks before this one have been processed
+uint64_t timer_time(void);
+
+#endif // #ifndef OCAML_RPI__TIMER_H
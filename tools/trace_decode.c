@@ -0,0 +1,428 @@
+/* trace_decode.c - rebuild kernel trace text on the host
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * usage: trace_decode kernel.elf kernel.symbols serial.log
+ *        trace_decode -r ADDR kernel.elf kernel.symbols memory.bin
+ *
+ * The kernel records trace events as a format string pointer, a time
+ * stamp and raw argument words (trace.h). This prints a serial log with
+ * every raw dump from trace_dump_raw() replaced by the text the kernel
+ * would have printed. Format strings and %s arguments are read from the
+ * allocated sections of kernel.elf, %p arguments are shown with the
+ * nearest symbol from kernel.symbols.
+ *
+ * With -r the input is a memory dump whose first byte is at virtual
+ * address ADDR, e.g. from QEMU "pmemsave 0 0x1000000 memory.bin" with
+ * -r 0xC0000000. The ring buffer is found through the symbols
+ * trace_ring and trace_head and every record still in it is printed.
+ *
+ * Arguments are 32 bit words; %lld and %llx take two words, low first.
+ */
+
+#define _GNU_SOURCE // memmem()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <elf.h>
+
+#include "../trace.h"
+
+// TraceRecord as the 32 bit kernel lays it out
+typedef struct RawRecord {
+    uint32_t time;
+    uint32_t fmt;
+    uint32_t arg[TRACE_ARGS];
+} RawRecord;
+
+/* Kernel image
+ *
+ * The allocated sections of kernel.elf, to read strings at the
+ * addresses the kernel recorded.
+ */
+typedef struct Section {
+    uint32_t addr;
+    uint32_t size;
+    const char *data;
+} Section;
+
+enum { MAX_SECTIONS = 64 };
+
+Section sections[MAX_SECTIONS];
+int num_sections = 0;
+
+// '\0' terminated string at addr in the image, or NULL
+const char *image_string(uint32_t addr) {
+    for(int i = 0; i < num_sections; ++i) {
+	Section *s = &sections[i];
+	if (addr >= s->addr && addr - s->addr < s->size) {
+	    const char *str = s->data + (addr - s->addr);
+	    if (memchr(str, 0, s->size - (addr - s->addr)) == NULL) return NULL;
+	    return str;
+	}
+    }
+    return NULL;
+}
+
+// keep the image loaded in buf, false if it is not a 32 bit ARM ELF
+bool load_elf(const char *buf, size_t size) {
+    const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)buf;
+    if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+	|| ehdr->e_ident[EI_CLASS] != ELFCLASS32
+	|| ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+	return false;
+    }
+    if (ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf32_Shdr) > size) return false;
+    const Elf32_Shdr *shdr = (const Elf32_Shdr *)(buf + ehdr->e_shoff);
+    for(int i = 0; i < ehdr->e_shnum && num_sections < MAX_SECTIONS; ++i) {
+	if ((shdr[i].sh_flags & SHF_ALLOC) == 0 || shdr[i].sh_type != SHT_PROGBITS) continue;
+	if (shdr[i].sh_offset + (uint64_t)shdr[i].sh_size > size) return false;
+	Section *s = &sections[num_sections++];
+	s->addr = shdr[i].sh_addr;
+	s->size = shdr[i].sh_size;
+	s->data = buf + shdr[i].sh_offset;
+    }
+    return true;
+}
+
+/* Symbols
+ *
+ * kernel.symbols is "objdump -t" output:
+ *   c0008000 g     F .text	00000040 Start
+ */
+typedef struct Symbol {
+    uint32_t addr;
+    uint32_t size;
+    char *name;
+} Symbol;
+
+Symbol *symbols = NULL;
+size_t num_symbols = 0;
+
+int symbol_cmp(const void *a, const void *b) {
+    const Symbol *x = a, *y = b;
+    if (x->addr != y->addr) return (x->addr < y->addr) ? -1 : 1;
+    // prefer sized symbols at the same address
+    return (x->size > y->size) ? -1 : (x->size < y->size);
+}
+
+void load_symbols(FILE *file) {
+    char line[1024];
+    size_t cap = 0;
+    while(fgets(line, sizeof(line), file) != NULL) {
+	unsigned addr, size;
+	char name[512];
+	char *tab = strchr(line, '\t');
+	if (tab == NULL || sscanf(line, "%x", &addr) != 1) continue;
+	if (sscanf(tab + 1, "%x %511s", &size, name) != 2) continue;
+	// skip section and file symbols
+	if (strstr(line, " d ") != NULL || strstr(line, " df ") != NULL) continue;
+	if (num_symbols == cap) {
+	    cap = cap ? 2 * cap : 1024;
+	    symbols = realloc(symbols, cap * sizeof(Symbol));
+	}
+	symbols[num_symbols].addr = addr;
+	symbols[num_symbols].size = size;
+	symbols[num_symbols].name = strdup(name);
+	++num_symbols;
+    }
+    qsort(symbols, num_symbols, sizeof(Symbol), symbol_cmp);
+}
+
+// symbol containing addr, or at addr if it has no size
+const Symbol *symbol_at(uint32_t addr) {
+    size_t lo = 0, hi = num_symbols;
+    // first symbol above addr
+    while(lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (symbols[mid].addr <= addr) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    // the largest symbol starting at the closest address below
+    while(lo > 0) {
+	const Symbol *s = &symbols[--lo];
+	if (lo > 0 && symbols[lo - 1].addr == s->addr) continue;
+	if (addr - s->addr < s->size || addr == s->addr) return s;
+	return NULL;
+    }
+    return NULL;
+}
+
+const Symbol *symbol_named(const char *name) {
+    for(size_t i = 0; i < num_symbols; ++i) {
+	if (strcmp(symbols[i].name, name) == 0) return &symbols[i];
+    }
+    return NULL;
+}
+
+/* Formatting
+ *
+ * Each conversion of the kernel's printf takes one argument word. The
+ * conversion is rebuilt as a host printf spec with the value widened to
+ * 64 bit, which prints the formats used in traces like the kernel does.
+ */
+void format_record(FILE *out, const char *fmt, const uint32_t *arg, int nargs) {
+    int next = 0;
+#define NEXT_ARG() ((next < nargs) ? arg[next++] : 0)
+    while(*fmt != 0) {
+	if (*fmt != '%') {
+	    fputc(*fmt++, out);
+	    continue;
+	}
+	const char *start = fmt++;
+	char spec[64];
+	size_t len = 0;
+	spec[len++] = '%';
+	while(*fmt != 0 && strchr("+- #0", *fmt) != NULL && len < 8) spec[len++] = *fmt++;
+	// width and precision, '*' takes an argument
+	for(int part = 0; part < 2; ++part) {
+	    if (part == 1) {
+		if (*fmt != '.') break;
+		spec[len++] = *fmt++;
+	    }
+	    if (*fmt == '*') {
+		++fmt;
+		len += snprintf(spec + len, 16, "%" PRId32, (int32_t)NEXT_ARG());
+	    } else {
+		while(*fmt >= '0' && *fmt <= '9' && len < 40) spec[len++] = *fmt++;
+	    }
+	}
+	// length
+	int bits = 32;
+	if (fmt[0] == 'h' && fmt[1] == 'h') {
+	    bits = 8;
+	    fmt += 2;
+	} else if (fmt[0] == 'h') {
+	    bits = 16;
+	    ++fmt;
+	} else if (fmt[0] == 'l' && fmt[1] == 'l') {
+	    bits = 64;
+	    fmt += 2;
+	} else if (fmt[0] == 'j' || fmt[0] == 'q') {
+	    bits = 64;
+	    ++fmt;
+	} else if (fmt[0] == 'l' || fmt[0] == 'z' || fmt[0] == 't') {
+	    ++fmt;
+	}
+	char conv = *fmt++;
+	uint64_t word = 0;
+	switch(conv) {
+	case 'd':
+	case 'i':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o':
+	    word = NEXT_ARG();
+	    if (bits == 64) word |= (uint64_t)NEXT_ARG() << 32;
+	    if (conv == 'd' || conv == 'i') {
+		int64_t v = (bits == 8) ? (int8_t)word : (bits == 16) ? (int16_t)word
+		    : (bits == 32) ? (int32_t)word : (int64_t)word;
+		strcpy(spec + len, "lld");
+		fprintf(out, spec, (long long)v);
+	    } else {
+		if (bits < 64) word &= (1ull << bits) - 1;
+		spec[len++] = 'l';
+		spec[len++] = 'l';
+		spec[len++] = conv;
+		spec[len] = 0;
+		fprintf(out, spec, (unsigned long long)word);
+	    }
+	    break;
+	case 'c':
+	    strcpy(spec + len, "c");
+	    fprintf(out, spec, (int)(uint8_t)NEXT_ARG());
+	    break;
+	case 's': {
+	    uint32_t addr = NEXT_ARG();
+	    const char *str = image_string(addr);
+	    if (str == NULL) {
+		fprintf(out, "<%#" PRIx32 ">", addr);
+	    } else {
+		strcpy(spec + len, "s");
+		fprintf(out, spec, str);
+	    }
+	    break;
+	}
+	case 'p': {
+	    uint32_t addr = NEXT_ARG();
+	    fprintf(out, "0x%08" PRIx32, addr);
+	    const Symbol *sym = symbol_at(addr);
+	    if (sym != NULL) {
+		fprintf(out, " <%s", sym->name);
+		if (addr != sym->addr) fprintf(out, "+%#" PRIx32, addr - sym->addr);
+		fputc('>', out);
+	    }
+	    break;
+	}
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	    // the trace macros converted the double to an integer word
+	    strcpy(spec + len, "d");
+	    fprintf(out, spec, (int)(int32_t)NEXT_ARG());
+	    break;
+	case '%':
+	    fputc('%', out);
+	    break;
+	default:
+	    // unknown conversions are copied verbatim
+	    if (conv == 0) --fmt;
+	    fwrite(start, 1, fmt - start, out);
+	}
+    }
+#undef NEXT_ARG
+}
+
+// print a record like trace_print() in trace.c
+void print_record(FILE *out, const RawRecord *rec) {
+    fprintf(out, "[%10" PRIu32 "] ", rec->time);
+    const char *fmt = image_string(rec->fmt);
+    if (fmt == NULL) {
+	fprintf(out, "<bad format %#" PRIx32 ">", rec->fmt);
+	for(int i = 0; i < TRACE_ARGS; ++i) fprintf(out, " %#" PRIx32, rec->arg[i]);
+    } else {
+	format_record(out, fmt, rec->arg, TRACE_ARGS);
+    }
+    fputc('\n', out);
+}
+
+/* Inputs
+ */
+
+// copy a serial log to out, decoding raw dumps, returns the number of
+// dumps or -1 if one is cut short
+int decode_log(FILE *out, const char *buf, size_t size) {
+    const size_t magic_len = strlen(TRACE_RAW_MAGIC);
+    int dumps = 0;
+    size_t pos = 0;
+    while(pos < size) {
+	const char *found = memmem(buf + pos, size - pos, TRACE_RAW_MAGIC, magic_len);
+	size_t text = (found != NULL) ? (size_t)(found - buf) - pos : size - pos;
+	fwrite(buf + pos, 1, text, out);
+	pos += text;
+	if (found == NULL) break;
+
+	TraceRawHeader header;
+	if (size - pos < sizeof(header)) return -1;
+	memcpy(&header, buf + pos, sizeof(header));
+	pos += sizeof(header);
+	if (header.record_size != sizeof(RawRecord)
+	    || (size - pos) / sizeof(RawRecord) < header.count) {
+	    fprintf(stderr, "trace_decode: truncated or foreign dump at offset %zu\n",
+		    pos - sizeof(header));
+	    return -1;
+	}
+	if (header.lost > 0) fprintf(out, "# trace: %" PRIu32 " records lost\n", header.lost);
+	for(uint32_t i = 0; i < header.count; ++i) {
+	    RawRecord rec;
+	    memcpy(&rec, buf + pos, sizeof(rec));
+	    pos += sizeof(rec);
+	    print_record(out, &rec);
+	}
+	++dumps;
+    }
+    return dumps;
+}
+
+// print the ring buffer from a memory dump starting at base
+bool decode_memory(FILE *out, const char *buf, size_t size, uint32_t base) {
+    const Symbol *ring = symbol_named("trace_ring");
+    const Symbol *head = symbol_named("trace_head");
+    if (ring == NULL || head == NULL) {
+	fprintf(stderr, "trace_decode: trace_ring or trace_head not in the symbols\n");
+	return false;
+    }
+    uint32_t records = ring->size / sizeof(RawRecord);
+    if (head->addr - base + 4 > size || ring->addr - base + (uint64_t)ring->size > size
+	|| head->addr < base || ring->addr < base || records == 0) {
+	fprintf(stderr, "trace_decode: the ring buffer is not in the memory dump\n");
+	return false;
+    }
+    uint32_t count;
+    memcpy(&count, buf + (head->addr - base), sizeof(count));
+    uint32_t first = (count > records) ? count - records : 0;
+    if (first > 0) fprintf(out, "# trace: %" PRIu32 " records lost\n", first);
+    for(uint32_t i = first; i != count; ++i) {
+	RawRecord rec;
+	memcpy(&rec, buf + (ring->addr - base) + (i % records) * sizeof(rec), sizeof(rec));
+	print_record(out, &rec);
+    }
+    return true;
+}
+
+char *read_file(const char *name, size_t *size) {
+    FILE *file = fopen(name, "rb");
+    if (file == NULL) {
+	perror(name);
+	exit(1);
+    }
+    size_t cap = 1 << 16;
+    char *buf = malloc(cap);
+    *size = 0;
+    size_t got;
+    while((got = fread(buf + *size, 1, cap - *size, file)) > 0) {
+	*size += got;
+	if (*size == cap) buf = realloc(buf, cap *= 2);
+    }
+    fclose(file);
+    return buf;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: trace_decode [-r ADDR] kernel.elf kernel.symbols FILE\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    bool memory = false;
+    uint32_t base = 0;
+    int arg = 1;
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+	if (argc < 3) usage();
+	memory = true;
+	base = strtoul(argv[2], NULL, 0);
+	arg = 3;
+    }
+    if (argc - arg != 3) usage();
+
+    size_t elf_size, size;
+    char *elf = read_file(argv[arg], &elf_size);
+    if (!load_elf(elf, elf_size)) {
+	fprintf(stderr, "trace_decode: %s is not a 32 bit little endian ELF\n", argv[arg]);
+	return 1;
+    }
+    FILE *file = fopen(argv[arg + 1], "r");
+    if (file == NULL) {
+	perror(argv[arg + 1]);
+	return 1;
+    }
+    load_symbols(file);
+    fclose(file);
+    char *buf = read_file(argv[arg + 2], &size);
+    if (memory) return decode_memory(stdout, buf, size, base) ? 0 : 1;
+    return (decode_log(stdout, buf, size) < 0) ? 1 : 0;
+}
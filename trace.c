@@ -0,0 +1,104 @@
+/* trace.c - In-memory trace ring buffer
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Record trace events into a ring buffer and drain it to the UART.
+ * With TRACE_ECHO every record is also printed as it happens, with
+ * TRACE_RAW trace_dump() sends the records unformatted.
+ */
+
+#include <stdint.h>
+#include "mmio.h"
+#include "irq.h"
+#include "uart.h"
+#include "printf.h"
+#include "trace.h"
+
+enum {
+    // system timer, low word of the free running 1MHz counter
+    TRACE_TIMER_CLO = 0xE0003004,
+};
+
+TraceRecord trace_ring[TRACE_RECORDS];
+uint32_t trace_head = 0; // records written ever
+uint32_t trace_tail = 0; // records dumped ever
+
+#if !defined(TRACE_RAW) || defined(TRACE_ECHO)
+static void trace_print(const TraceRecord *rec) {
+    printf("[%10u] ", rec->time);
+    printf(rec->fmt, rec->arg[0], rec->arg[1], rec->arg[2], rec->arg[3]);
+    putchar('\n');
+}
+#endif
+
+void trace_record(const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3) {
+    uint32_t cpsr = irq_save();
+    TraceRecord *rec = &trace_ring[trace_head++ & (TRACE_RECORDS - 1)];
+    rec->time = mmio_read(TRACE_TIMER_CLO);
+    rec->fmt = fmt;
+    rec->arg[0] = a0;
+    rec->arg[1] = a1;
+    rec->arg[2] = a2;
+    rec->arg[3] = a3;
+#ifdef TRACE_ECHO
+    trace_tail = trace_head;
+    trace_print(rec);
+#endif
+    irq_restore(cpsr);
+}
+
+// skip records overwritten since the last dump, returns how many
+static uint32_t trace_skip_lost(void) {
+    uint32_t lost = 0;
+    if (trace_head - trace_tail > TRACE_RECORDS) {
+	lost = trace_head - trace_tail - TRACE_RECORDS;
+	trace_tail = trace_head - TRACE_RECORDS;
+    }
+    return lost;
+}
+
+void trace_dump_raw(void) {
+    uint32_t cpsr = irq_save();
+    TraceRawHeader header = { TRACE_RAW_MAGIC, sizeof(TraceRecord), 0, 0 };
+    header.lost = trace_skip_lost();
+    header.count = trace_head - trace_tail;
+    puts("# trace: raw\n");
+    uart_write_all((const char *)&header, sizeof(header));
+    // the ring may wrap, send it in up to two pieces
+    while(trace_tail != trace_head) {
+	uint32_t pos = trace_tail & (TRACE_RECORDS - 1);
+	uint32_t count = trace_head - trace_tail;
+	if (count > TRACE_RECORDS - pos) count = TRACE_RECORDS - pos;
+	uart_write_all((const char *)&trace_ring[pos], count * sizeof(TraceRecord));
+	trace_tail += count;
+    }
+    irq_restore(cpsr);
+}
+
+void trace_dump(void) {
+#ifdef TRACE_RAW
+    trace_dump_raw();
+#else
+    uint32_t cpsr = irq_save();
+    uint32_t lost = trace_skip_lost();
+    if (lost > 0) printf("# trace: %u records lost\n", lost);
+    while(trace_tail != trace_head) {
+	trace_print(&trace_ring[trace_tail++ & (TRACE_RECORDS - 1)]);
+    }
+    irq_restore(cpsr);
+#endif
+}
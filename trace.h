@@ -0,0 +1,95 @@
+/* trace.h - In-memory trace ring buffer
+ * Copyright (C) 2013 Goswin von Brederlow <goswin-v-b@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * Hot paths log fixed size binary records into a ring buffer in RAM
+ * instead of printing to the UART. A record is a time stamp, a format
+ * string and up to TRACE_ARGS word sized arguments, formatting only
+ * happens when trace_dump() drains the buffer. Levels above TRACE_LEVEL
+ * compile to nothing, arguments are not even evaluated.
+ *
+ * Format strings and string arguments must be static, only the pointers
+ * are recorded.
+ *
+ * trace_dump_raw() sends the records unformatted, tools/trace_decode
+ * rebuilds the text on the host from the strings in kernel.elf and the
+ * addresses in kernel.symbols. Build with "make TRACE_RAW=1" to have
+ * trace_dump() do that, so the target never formats trace records.
+ */
+
+#ifndef OCAML_RPI__TRACE_H
+#define OCAML_RPI__TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_ERROR 1 // something is wrong, e.g. a stub giving bad results
+#define TRACE_LEVEL_INFO  2 // rare events
+#define TRACE_LEVEL_DEBUG 3 // hot paths
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+enum {
+    TRACE_ARGS = 4,
+    TRACE_RECORDS = 1024, // must be a power of 2
+};
+
+// read by tools/trace_decode as 32 bit little endian words
+typedef struct TraceRecord {
+    uint32_t time;   // system timer in us
+    const char *fmt; // printf format without the newline
+    uint32_t arg[TRACE_ARGS];
+} TraceRecord;
+
+/* A raw dump is the line "# trace: raw\n", a TraceRawHeader and count
+ * TraceRecords, oldest first.
+ */
+#define TRACE_RAW_MAGIC "TRACERAW"
+
+typedef struct TraceRawHeader {
+    char magic[8];        // TRACE_RAW_MAGIC without the '\0'
+    uint32_t record_size; // sizeof(TraceRecord)
+    uint32_t count;       // records following
+    uint32_t lost;        // records overwritten before this dump
+} TraceRawHeader;
+
+void trace_record(const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+
+// print all records not printed yet to the UART, oldest first
+void trace_dump(void);
+
+// send all records not sent yet to the UART as a raw dump
+void trace_dump_raw(void);
+
+#define TRACE_AT_(level, fmt, a0, a1, a2, a3, ...)			\
+    do {								\
+	if ((level) <= TRACE_LEVEL) {					\
+	    trace_record(fmt, (uint32_t)(uintptr_t)(a0),		\
+			 (uint32_t)(uintptr_t)(a1),			\
+			 (uint32_t)(uintptr_t)(a2),			\
+			 (uint32_t)(uintptr_t)(a3));			\
+	}								\
+    } while(0)
+
+#define TRACE_AT(level, ...) TRACE_AT_(level, __VA_ARGS__, 0, 0, 0, 0)
+#define TRACE_ERROR(...) TRACE_AT(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#define TRACE_INFO(...) TRACE_AT(TRACE_LEVEL_INFO, __VA_ARGS__)
+#define TRACE_DEBUG(...) TRACE_AT(TRACE_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // #ifndef OCAML_RPI__TRACE_H
@@ -25,7 +25,10 @@
 #include <stdbool.h>
 
 #include "mmio.h"
+#include "string.h"
+#include "irq.h"
 #include "uart.h"
+#include "trace.h"
 
 enum {
     // The GPIO registers base address.
@@ -63,6 +66,62 @@ enum {
     UART0_TDR    = (UART0_BASE + 0x8C),
 };
 
+enum {
+    // UART0_FR bits
+    FR_RXFE = 1 << 4, // receive FIFO empty
+    FR_TXFF = 1 << 5, // transmit FIFO full
+    FR_TXFE = 1 << 7, // transmit FIFO empty
+
+    FIFO_SIZE = 16,
+
+    // UART0_IMSC, UART0_MIS and UART0_ICR bits
+    INT_RX = 1 << 4,
+    INT_TX = 1 << 5,
+    INT_RT = 1 << 6, // receive timeout
+    INT_ALL = 0x7FF,
+
+    // UART0_IFLS: TX interrupt when the FIFO drops to 1/8 full,
+    // RX interrupt when it fills to 1/8
+    IFLS_TX_1_8 = 0 << 0,
+    IFLS_RX_1_8 = 0 << 3,
+};
+
+/* Transmit ring buffer
+ *
+ * putchar() only appends to the ring and tops up the FIFO. The TX
+ * interrupt fires when the FIFO drains below the IFLS level and refills
+ * it from the ring, so writers never wait for the wire unless the ring
+ * is full. Then the writer drains the ring itself by polling, which also
+ * works with IRQs disabled. After uart_sync() every byte goes straight
+ * to the FIFO again and received bytes are fetched by polling, for
+ * panic() and exception handlers.
+ */
+enum {
+    TX_RING_SIZE = 4096, // must be a power of 2
+};
+
+char uart_tx_ring[TX_RING_SIZE];
+volatile uint32_t uart_tx_head = 0; // bytes added ever
+volatile uint32_t uart_tx_tail = 0; // bytes sent ever
+bool uart_polled = false;
+
+// move bytes from the ring to the FIFO until one is empty/full, IRQs off
+static void uart_tx_fill(void) {
+    while(uart_tx_tail != uart_tx_head) {
+	uint32_t fr = mmio_read(UART0_FR);
+	if (fr & FR_TXFF) break;
+	// an empty FIFO takes a full load without asking again
+	uint32_t room = (fr & FR_TXFE) ? FIFO_SIZE : 1;
+	while(room-- > 0 && uart_tx_tail != uart_tx_head) {
+	    mmio_write(UART0_DR, uart_tx_ring[uart_tx_tail++ & (TX_RING_SIZE - 1)]);
+	}
+    }
+    // only listen to the FIFO while there is more to send
+    uint32_t imsc = mmio_read(UART0_IMSC) & ~INT_TX;
+    if (uart_tx_tail != uart_tx_head) imsc |= INT_TX;
+    mmio_write(UART0_IMSC, imsc);
+}
+
 /*
  * delay function
  * int32_t delay: number of cycles to delay
@@ -75,6 +134,34 @@ void delay(int32_t count) {
 		 : : [count]"r"(count));
 }
     
+/* Receive ring buffer
+ *
+ * The RX interrupt fires when the FIFO fills to the IFLS level and the
+ * receive timeout interrupt when fewer bytes sit in it for a while, both
+ * move everything in the FIFO to the ring. Bytes arriving while the
+ * ring is full are dropped and counted.
+ */
+enum {
+    RX_RING_SIZE = 1024, // must be a power of 2
+};
+
+char uart_rx_ring[RX_RING_SIZE];
+volatile uint32_t uart_rx_head = 0; // bytes received ever
+volatile uint32_t uart_rx_tail = 0; // bytes read ever
+uint32_t uart_rx_dropped = 0;
+
+// move bytes from the FIFO to the ring, IRQs off
+static void uart_rx_drain(void) {
+    while(!(mmio_read(UART0_FR) & FR_RXFE)) {
+	char c = mmio_read(UART0_DR);
+	if (uart_rx_head - uart_rx_tail == RX_RING_SIZE) {
+	    ++uart_rx_dropped;
+	} else {
+	    uart_rx_ring[uart_rx_head++ & (RX_RING_SIZE - 1)] = c;
+	}
+    }
+}
+
 /*
  * Initialize UART0.
  */
@@ -110,10 +197,11 @@ void uart_init(void) {
     // Enable FIFO & 8 bit data transmissio (1 stop bit, no parity).
     mmio_write(UART0_LCRH, (1 << 4) | (1 << 5) | (1 << 6));
 
-    // Mask all interrupts.
-    mmio_write(UART0_IMSC, (1 << 1) | (1 << 4) | (1 << 5) |
-		(1 << 6) | (1 << 7) | (1 << 8) |
-		(1 << 9) | (1 << 10));
+    // Enable the receive interrupts only, a set bit in IMSC enables
+    // one. TX is enabled while there is output buffered.
+    mmio_write(UART0_IFLS, IFLS_TX_1_8 | IFLS_RX_1_8);
+    mmio_write(UART0_IMSC, INT_RX | INT_RT);
+    irq_enable(IRQ_UART);
 
     // Enable UART0, receive & transfer part of UART.
     mmio_write(UART0_CR, (1 << 0) | (1 << 8) | (1 << 9));
@@ -124,16 +212,77 @@ void uart_init(void) {
  * int c: character to send.
  */
 int putchar(int c) {
-    // wait for UART to become ready to transmit
-    while(true) {
-	if (!(mmio_read(UART0_FR) & (1 << 5))) {
-	    break;
+    uint32_t cpsr = irq_save();
+    if (uart_polled) {
+	// wait for UART to become ready to transmit
+	while(mmio_read(UART0_FR) & FR_TXFF) { }
+	mmio_write(UART0_DR, c);
+    } else {
+	while(uart_tx_head - uart_tx_tail == TX_RING_SIZE) {
+	    // ring full, drain it ourself
+	    uart_tx_fill();
 	}
+	uart_tx_ring[uart_tx_head++ & (TX_RING_SIZE - 1)] = c;
+	uart_tx_fill();
     }
-    mmio_write(UART0_DR, c);
+    irq_restore(cpsr);
     return c;
 }
 
+size_t uart_write(const char *buf, size_t count) {
+    uint32_t cpsr = irq_save();
+    size_t n = 0;
+    if (uart_polled) {
+	// wait for UART to become ready to transmit, a FIFO at a time
+	while(n < count) {
+	    uint32_t fr = mmio_read(UART0_FR);
+	    if (fr & FR_TXFF) continue;
+	    uint32_t room = (fr & FR_TXFE) ? FIFO_SIZE : 1;
+	    while(room-- > 0 && n < count) mmio_write(UART0_DR, buf[n++]);
+	}
+    } else {
+	while(n < count && uart_tx_head - uart_tx_tail < TX_RING_SIZE) {
+	    uart_tx_ring[uart_tx_head++ & (TX_RING_SIZE - 1)] = buf[n++];
+	}
+	uart_tx_fill();
+    }
+    irq_restore(cpsr);
+    return n;
+}
+
+void uart_write_all(const char *buf, size_t count) {
+    while(count > 0) {
+	size_t n = uart_write(buf, count);
+	if (n == 0) {
+	    // ring full, drain it ourself
+	    uint32_t cpsr = irq_save();
+	    uart_tx_fill();
+	    irq_restore(cpsr);
+	}
+	buf += n;
+	count -= n;
+    }
+}
+
+bool uart_write_ready(void) {
+    return uart_polled || uart_tx_head - uart_tx_tail < TX_RING_SIZE;
+}
+
+void uart_irq(void) {
+    uint32_t mis = mmio_read(UART0_MIS);
+    mmio_write(UART0_ICR, mis);
+    if (mis & INT_TX) uart_tx_fill();
+    if (mis & (INT_RX | INT_RT)) uart_rx_drain();
+}
+
+void uart_sync(void) {
+    uint32_t cpsr = irq_save();
+    while(uart_tx_tail != uart_tx_head) uart_tx_fill();
+    mmio_write(UART0_IMSC, 0);
+    uart_polled = true;
+    irq_restore(cpsr);
+}
+
 /*
  * Receive a byte via UART0.
  *
@@ -141,13 +290,35 @@ int putchar(int c) {
  * uint8_t: byte received.
  */
 char getc(void) {
-    // wait for UART to have recieved something
-    while(true) {
-	if (!(mmio_read(UART0_FR) & (1 << 4))) {
-	    break;
-	}
+    char c;
+    while(uart_read(&c, 1) == 0) {
+	// after uart_sync() no RX IRQ would end the wait, keep polling
+	if (uart_polled) continue;
+	// wait for UART to have recieved something
+	uint32_t cpsr = irq_save();
+	if (!uart_poll()) irq_wait();
+	irq_restore(cpsr);
+    }
+    return c;
+}
+
+bool uart_poll(void) {
+    uint32_t cpsr = irq_save();
+    if (uart_polled) uart_rx_drain();
+    bool res = uart_rx_tail != uart_rx_head;
+    irq_restore(cpsr);
+    return res;
+}
+
+size_t uart_read(char *buf, size_t count) {
+    uint32_t cpsr = irq_save();
+    if (uart_polled) uart_rx_drain();
+    size_t n = 0;
+    while(n < count && uart_rx_tail != uart_rx_head) {
+	buf[n++] = uart_rx_ring[uart_rx_tail++ & (RX_RING_SIZE - 1)];
     }
-    return mmio_read(UART0_DR);
+    irq_restore(cpsr);
+    return n;
 }
 
 /*
@@ -155,9 +326,7 @@ char getc(void) {
  * const char *str: 0-terminated string
  */
 int puts(const char *str) {
-    while(*str) {
-	putchar(*str++);
-    }
+    uart_write_all(str, strlen(str));
     return 0;
 }
 
@@ -165,6 +334,10 @@ int puts(const char *str) {
 void __attribute__((noreturn)) abort(void);
 
 void __attribute__((noreturn)) panic(const char *msg) {
+    // flush and print without interrupts from here on
+    uart_sync();
+    // show how we got here
+    trace_dump();
     puts(msg);
     delay(100000000);
     abort();
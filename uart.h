@@ -25,6 +25,7 @@
 #define MOOSE_KERNEL_UART_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 void uart_init(void);
     
@@ -38,11 +39,17 @@ void uart_init(void);
 void delay(int32_t count);
 
 /*
- * Receive a character via UART0.
+ * Receive a character via UART0, sleeps until one arrives.
  * returns: character received.
  */
 char getc(void);
 
+/*
+ * Take up to count received bytes without waiting.
+ * returns: number of bytes read, 0 if none are buffered.
+ */
+size_t uart_read(char *buf, size_t count);
+
 /*
  * Check if data is available via UART0.
  * returns: data available?
@@ -55,6 +62,34 @@ _Bool uart_poll(void);
  */
 int putchar(int c);
 
+/*
+ * Queue up to count bytes for sending without waiting for the ring
+ * buffer to drain.
+ * returns: number of bytes taken, 0 if the ring buffer is full.
+ */
+size_t uart_write(const char *buf, size_t count);
+
+/*
+ * Send count bytes, draining the ring buffer by polling if it fills up.
+ * Safe with IRQs disabled.
+ */
+void uart_write_all(const char *buf, size_t count);
+
+/*
+ * Check if uart_write() would take at least one byte.
+ */
+_Bool uart_write_ready(void);
+
+/*
+ * UART interrupt, called from exception_irq_handler()
+ */
+void uart_irq(void);
+
+/*
+ * send everything buffered and print synchronously from now on
+ */
+void uart_sync(void);
+
 /*
  * print a string to the UART one character at a time
  * str: 0-terminated string